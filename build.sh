@@ -213,7 +213,7 @@ cp terminal/luacmd.trm "$GNUPLOT_SRC_DIR/term/"
 
 # Copy library wrapper files
 echo "  Copying library wrapper files..."
-cp src/libgnuplot.h src/libgnuplot.c "$GNUPLOT_SRC_DIR/src/"
+cp src/libgnuplot.h src/libgnuplot.c src/luacmd_image.h "$GNUPLOT_SRC_DIR/src/"
 
 # Note: We no longer copy winstubs files - not needed with correct build flags
 
@@ -513,6 +513,15 @@ SKIP_COUNT=0
 SKIP_FILES=()
 SKIP_FILES+=("vms.c")  # VMS-specific (skip on all platforms)
 
+# libgnuplot.c provides hashed get_udv_by_name()/add_udv_by_name();
+# eval.c keeps its linear versions under other names
+UDV_RENAME_FLAGS="-Dget_udv_by_name=gp_linear_get_udv_by_name -Dadd_udv_by_name=gp_linear_add_udv_by_name"
+
+# Cancellation points outside the terminal (see libgnuplot.c): function
+# sampling in plot2d.c/plot3d.c and data reading go through libgnuplot.c
+SAMPLE_CANCEL_FLAGS="-Devaluate_at=gp_sampled_evaluate_at"
+READLINE_CANCEL_FLAGS="-Ddf_readline=gp_unchecked_df_readline"
+
 for src in "${SOURCES[@]}"; do
     srcfile="$GNUPLOT_SRC/$src"
     # Preserve directory structure for object files
@@ -546,6 +555,15 @@ for src in "${SOURCES[@]}"; do
             COMPILER="gcc"
             COMPILER_FLAGS="$CFLAGS"
         fi
+        if [ "$src" = "eval.c" ]; then
+            COMPILER_FLAGS="$COMPILER_FLAGS $UDV_RENAME_FLAGS"
+        fi
+        if [ "$src" = "plot2d.c" ] || [ "$src" = "plot3d.c" ]; then
+            COMPILER_FLAGS="$COMPILER_FLAGS $SAMPLE_CANCEL_FLAGS"
+        fi
+        if [ "$src" = "datafile.c" ]; then
+            COMPILER_FLAGS="$COMPILER_FLAGS $READLINE_CANCEL_FLAGS"
+        fi
         if $COMPILER $COMPILER_FLAGS $INCLUDES -c "$srcfile" -o "$objfile" 2>"$BUILD_DIR/compile_errors.tmp"; then
             echo "✓"
             OBJECTS="$OBJECTS $objfile"
@@ -581,7 +599,8 @@ fi
 echo "Step 5: Compiling libgnuplot wrapper..."
 
 # Add BUILDING_GNUPLOT_DLL for Windows DLL export
-if gcc $CFLAGS $INCLUDES -DBUILDING_GNUPLOT_DLL -c "$GNUPLOT_SRC/libgnuplot.c" -o "$BUILD_DIR/libgnuplot_wrapper.o" 2>&1 | tee "$BUILD_DIR/compile_lib.log"; then
+# GNUPLOT_UDV_INDEX: replace eval.c's variable lookups (see Step 4)
+if gcc $CFLAGS $INCLUDES -DBUILDING_GNUPLOT_DLL -DGNUPLOT_UDV_INDEX -c "$GNUPLOT_SRC/libgnuplot.c" -o "$BUILD_DIR/libgnuplot_wrapper.o" 2>&1 | tee "$BUILD_DIR/compile_lib.log"; then
     echo "✓ Library wrapper compiled"
 else
     echo "✗ Failed to compile library wrapper"
@@ -612,8 +631,8 @@ if [ "$PLATFORM" = "windows" ]; then
     g++ -shared -Wl,--allow-shlib-undefined -o libgnuplot.$LIB_EXT "$BUILD_DIR/libgnuplot_wrapper.o" $OBJECTS -lm $EXTRA_LIBS 2>&1 | tee "$BUILD_DIR/link.log"
     LINK_STATUS=$?
 else
-    # Unix/Linux - link with common libraries
-    EXTRA_LIBS="-lm"
+    # Unix/Linux - link with common libraries (pthread for dataset loading)
+    EXTRA_LIBS="-lm -lpthread"
     if [ $HAVE_LIBGD -eq 1 ]; then
         EXTRA_LIBS="$EXTRA_LIBS -lgd"
     fi
@@ -634,9 +653,27 @@ else
 fi
 echo ""
 
+# Step 6b: Build render daemon (Unix only - uses descriptor passing)
+if [ "$PLATFORM" != "windows" ]; then
+    echo "Step 6b: Building gnuplotd render daemon..."
+    if gcc -O2 -D_GNU_SOURCE -o gnuplotd src/gnuplotd.c src/gnuplotd_client.c \
+        -I. -L. -lgnuplot -Wl,-rpath,'$ORIGIN' 2>&1 | tee "$BUILD_DIR/gnuplotd_build.log"; then
+        echo "✓ gnuplotd created"
+    else
+        echo "⚠ Warning: gnuplotd build failed (see $BUILD_DIR/gnuplotd_build.log)"
+    fi
+    echo ""
+fi
+
 # Step 7: Build Lua module
 echo "Step 7: Building Lua module..."
 
+# The Lua module carries the gnuplotd client on Unix
+LUA_SOURCES="src/lua_gnuplot.c"
+if [ "$PLATFORM" != "windows" ]; then
+    LUA_SOURCES="$LUA_SOURCES src/gnuplotd_client.c"
+fi
+
 # Detect Lua
 LUA_INCDIR=""
 LUA_LIBDIR=""
@@ -756,7 +793,7 @@ if [ -n "$LUA_INCDIR" ]; then
     fi
 
     # Build Lua module
-    if gcc -shared -o gnuplot.$LIB_EXT src/lua_gnuplot.c \
+    if gcc -shared -o gnuplot.$LIB_EXT $LUA_SOURCES \
         -I"$LUA_INCDIR" \
         -I"$GNUPLOT_SRC_DIR/src" \
         -I. \
@@ -764,7 +801,7 @@ if [ -n "$LUA_INCDIR" ]; then
         $LUA_LDFLAGS \
         -lm 2>"$BUILD_DIR/lua_build.log"; then
         echo "✓ gnuplot.$LIB_EXT (Lua module) created"
-    elif gcc -shared -o gnuplot.$LIB_EXT src/lua_gnuplot.c \
+    elif gcc -shared -o gnuplot.$LIB_EXT $LUA_SOURCES \
         -I"$LUA_INCDIR" \
         -I"$GNUPLOT_SRC_DIR/src" \
         -I. \
@@ -791,6 +828,7 @@ echo ""
 echo "Created files:"
 ls -lh libgnuplot.$LIB_EXT 2>/dev/null && echo "  ✓ libgnuplot.$LIB_EXT ($(du -h libgnuplot.$LIB_EXT | cut -f1))"
 ls -lh gnuplot.$LIB_EXT 2>/dev/null && echo "  ✓ gnuplot.$LIB_EXT ($(du -h gnuplot.$LIB_EXT | cut -f1))"
+ls -lh gnuplotd 2>/dev/null && echo "  ✓ gnuplotd ($(du -h gnuplotd | cut -f1))"
 echo ""
 
 echo "Build artifacts:"
@@ -819,3 +857,6 @@ echo "Build logs saved in $BUILD_DIR/:"
 echo "  - compile_lib.log"
 echo "  - link.log"
 echo "  - lua_build.log"
+if [ "$PLATFORM" != "windows" ]; then
+    echo "  - gnuplotd_build.log"
+fi
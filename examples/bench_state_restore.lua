@@ -0,0 +1,79 @@
+#!/usr/bin/env lua
+-- Benchmark: switching between widget configurations
+-- Compares gnuplot.state_restore() against re-sending each widget's
+-- commands after a reset, the way widgets switched before snapshots
+
+local wxgnuplot = require("wxgnuplot")
+
+local ROUNDS = 200
+
+wxgnuplot.init()
+wxgnuplot.cmd("set terminal luacmd size 800,600")
+
+-- Two widgets with typical setups
+local widgets = {
+    {
+        "set title 'Temperature'",
+        "set xlabel 'Time (s)'",
+        "set ylabel 'T (C)'",
+        "set yrange [0:40]",
+        "set grid",
+        "set key top left",
+        "set style line 1 lc rgb '#d62728' lw 2",
+        "offset = 273.15",
+        "f(t) = 20 + 10*sin(t/10)",
+    },
+    {
+        "set title 'Pressure'",
+        "set xlabel 'Time (s)'",
+        "set ylabel 'p (hPa)'",
+        "set logscale y",
+        "set format y '%.0f'",
+        "set style line 1 lc rgb '#1f77b4' lw 2",
+        "scale = 100",
+        "g(t) = 1013 + 5*cos(t/7)",
+    },
+}
+
+local function resend(commands)
+    wxgnuplot.cmd("reset")
+    for _, cmd in ipairs(commands) do
+        wxgnuplot.cmd(cmd)
+    end
+end
+
+-- Snapshot each widget once
+local states = {}
+for i, commands in ipairs(widgets) do
+    resend(commands)
+    states[i] = wxgnuplot.state_save()
+end
+
+-- A plot between switches, as a widget redraw would do
+local function time_switches(switch)
+    local start = os.clock()
+    for round = 1, ROUNDS do
+        local i = (round % #widgets) + 1
+        switch(i)
+        wxgnuplot.cmd("plot sin(x)")
+    end
+    return os.clock() - start
+end
+
+local t_resend = time_switches(function(i) resend(widgets[i]) end)
+local t_restore = time_switches(function(i) wxgnuplot.state_restore(states[i]) end)
+local t_plot = time_switches(function(i) end)
+
+print(string.format("%d switches with a plot each", ROUNDS))
+print(string.format("  plot only:      %8.2f ms", t_plot * 1000))
+print(string.format("  re-send:        %8.2f ms", t_resend * 1000))
+print(string.format("  state_restore:  %8.2f ms", t_restore * 1000))
+print(string.format("  switch speedup: %8.2fx",
+                    (t_resend - t_plot) / math.max(t_restore - t_plot, 1e-9)))
+
+-- Redrawing the same widget is free
+local start = os.clock()
+for round = 1, ROUNDS do
+    wxgnuplot.state_restore(states[1])
+end
+print(string.format("  same-widget restore x%d: %.2f ms", ROUNDS, (os.clock() - start) * 1000))
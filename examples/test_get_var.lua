@@ -0,0 +1,61 @@
+#!/usr/bin/env lua
+-- Test typed variable read-back, including arrays
+
+package.path = package.path .. ";../src/?.lua"
+
+local wxgnuplot = require("wxgnuplot")
+
+print("=== Variable Read-back Test ===")
+
+wxgnuplot.init()
+
+local failures = 0
+local function check(what, ok)
+    print((ok and "✓ " or "✗ ") .. what)
+    if not ok then
+        failures = failures + 1
+    end
+end
+
+-- Scalars
+wxgnuplot.cmd("n = 42")
+wxgnuplot.cmd("r = 2.5")
+wxgnuplot.cmd("s = 'text'")
+check("integer", wxgnuplot.get_var("n") == 42)
+check("real", wxgnuplot.get_var("r") == 2.5)
+check("string", wxgnuplot.get_var("s") == "text")
+
+-- Array with mixed elements and one left undefined
+wxgnuplot.cmd("array A[5]")
+wxgnuplot.cmd("A[1] = 1")
+wxgnuplot.cmd("A[2] = 2.5")
+wxgnuplot.cmd("A[3] = 'three'")
+wxgnuplot.cmd("A[5] = {1, -2}")
+
+local A = wxgnuplot.get_var("A")
+check("array is a table", type(A) == "table")
+check("A[1] integer", A[1] == 1)
+check("A[2] real", A[2] == 2.5)
+check("A[3] string", A[3] == "three")
+check("A[4] undefined", A[4] == nil)
+check("A[5] complex", type(A[5]) == "table" and A[5].real == 1 and A[5].imag == -2)
+check("no element past the size", A[6] == nil)
+
+-- Arrays filled by gnuplot itself
+wxgnuplot.cmd("array B[3] = [10, 20, 30]")
+local B = wxgnuplot.get_var("B")
+check("initialized array", B[1] == 10 and B[2] == 20 and B[3] == 30 and B[4] == nil)
+
+local all = wxgnuplot.get_vars("B")
+check("get_vars returns arrays", type(all.B) == "table" and all.B[3] == 30)
+
+-- Missing and invalid names
+check("undefined variable", wxgnuplot.get_var("no_such_variable") == nil)
+check("empty name", wxgnuplot.get_var("") == nil)
+
+if failures == 0 then
+    print("\nAll checks passed")
+else
+    print(string.format("\n%d check(s) failed", failures))
+    os.exit(1)
+end
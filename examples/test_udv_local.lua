@@ -0,0 +1,65 @@
+#!/usr/bin/env lua
+-- Test that 'local' variables shadow globals and vanish with their scope
+
+package.path = package.path .. ";../src/?.lua"
+
+local wxgnuplot = require("wxgnuplot")
+
+print("=== Local Variable Scope Test ===")
+
+wxgnuplot.init()
+
+local failures = 0
+local function check(what, ok)
+    print((ok and "✓ " or "✗ ") .. what)
+    if not ok then
+        failures = failures + 1
+    end
+end
+
+-- A global that the locals below shadow
+wxgnuplot.cmd("x = 1")
+
+-- Function block: the local is seen inside, the global outside
+wxgnuplot.run_script([[
+function $shadow(a) << EOF
+    local x = a * 100
+    return x + 1
+EOF
+]])
+wxgnuplot.cmd("inside = $shadow(2)")
+check("function block sees its local", wxgnuplot.get_var("inside") == 201)
+check("global unchanged after the block", wxgnuplot.get_var("x") == 1)
+wxgnuplot.cmd("again = $shadow(3) + x")
+check("global visible again in the same command", wxgnuplot.get_var("again") == 302)
+
+-- Load file: locals end with the file
+local script = os.tmpname()
+local f = assert(io.open(script, "w"))
+f:write("local x = 100\n")
+f:write("seen = x\n")
+f:write("local onlylocal = 7\n")
+f:write("seen_local = onlylocal\n")
+f:write("created = 5\n")
+f:close()
+wxgnuplot.cmd("load '" .. script .. "'")
+os.remove(script)
+
+check("load file sees its local", wxgnuplot.get_var("seen") == 100)
+check("load file sees a local-only name", wxgnuplot.get_var("seen_local") == 7)
+check("global unchanged after the file", wxgnuplot.get_var("x") == 1)
+check("local-only name gone after the file", wxgnuplot.get_var("onlylocal") == nil)
+check("global created inside the file survives", wxgnuplot.get_var("created") == 5)
+
+-- Names freed with the scope can be defined again as globals
+wxgnuplot.cmd("onlylocal = 8")
+check("redefined as a global", wxgnuplot.get_var("onlylocal") == 8)
+wxgnuplot.cmd("x = x + 1")
+check("global updated after the scopes", wxgnuplot.get_var("x") == 2)
+
+if failures == 0 then
+    print("\nAll checks passed")
+else
+    print(string.format("\n%d check(s) failed", failures))
+    os.exit(1)
+end
@@ -0,0 +1,853 @@
+/* GNUPLOT - gnuplotd.c */
+
+/*
+ * gnuplotd - local render daemon built on libgnuplot
+ *
+ * Keeps a pool of worker processes with gnuplot already initialized and
+ * serves plot jobs from local clients over a UNIX domain socket, so client
+ * processes do not each embed and initialize their own copy of gnuplot.
+ *
+ * The main process accepts connections and keeps a priority queue of
+ * pending jobs. Idle workers are handed up to <batch> jobs at a time,
+ * highest priority first (FIFO within a priority). A worker runs each job
+ * from a reset configuration, writes the frame into a shared memory file
+ * and passes the descriptor straight back to the client. See gnuplotd.h
+ * for the protocol.
+ *
+ * The main process remembers the jobs each worker holds, so a worker that
+ * dies (or is killed by its job timer) never leaves a client waiting.
+ *
+ * Usage: gnuplotd [-s socket_path] [-w workers] [-b batch] [-t timeout_ms]
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "libgnuplot.h"
+#include "gnuplotd.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_WORKERS     64
+#define MAX_CLIENTS     256
+#define MAX_BATCH       64
+#define MAX_CANVAS      32768
+#define JOB_GRACE_MS    2000    /* After the deadline, before the worker is killed */
+
+/* A queued job */
+typedef struct {
+    gnuplotd_request_t request;
+    int script_fd;
+    int client_fd;
+    unsigned long seq;          /* Arrival order, for FIFO within a priority */
+} job_t;
+
+/* A job handed to a worker, in the order the worker runs them */
+typedef struct {
+    uint32_t id;
+    uint32_t output;
+    int client_fd;              /* -1 once the client disconnected */
+} held_job_t;
+
+/* A worker process */
+typedef struct {
+    pid_t pid;
+    int fd;                     /* Control socket */
+    int pending;                /* Jobs handed over and not yet done */
+    held_job_t held[MAX_BATCH];
+} worker_t;
+
+static worker_t workers[MAX_WORKERS];
+static int worker_count = 4;
+static int batch_size = 4;
+static unsigned int job_timeout_ms = 60000;  /* 0 = none */
+
+static int clients[MAX_CLIENTS];
+static int client_count = 0;
+
+/* Binary max-heap of pending jobs */
+static job_t *queue = NULL;
+static int queue_count = 0;
+static int queue_size = 0;
+static unsigned long next_seq = 0;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void
+on_signal(int sig)
+{
+    (void) sig;
+    stop_requested = 1;
+}
+
+/* ------------------------------------------------------------------ */
+/* Worker side                                                          */
+/* ------------------------------------------------------------------ */
+
+/* Serialize the luacmd capture into a command frame */
+static int
+write_commands_frame(uint64_t *frame_size)
+{
+    int count, width, height;
+    luacmd_command_t *commands = luacmd_get_commands(&count, &width, &height);
+    gnuplotd_commands_header_t *header;
+    gnuplotd_command_t *records;
+    size_t size, offset;
+    unsigned char *map;
+    int fd = -1;
+    int i;
+
+    /* Records first, then text, pixels and polygon corners */
+    size = sizeof(gnuplotd_commands_header_t) + (size_t)count * sizeof(gnuplotd_command_t);
+    for (i = 0; i < count; i++) {
+        if (commands[i].text) {
+            size += strlen(commands[i].text) + 1;
+        }
+        if (commands[i].image) {
+            size = (size + 7) & ~(size_t)7;
+            size += (size_t)commands[i].image->width * commands[i].image->height * 4;
+        }
+        if (commands[i].points) {
+            size = (size + 7) & ~(size_t)7;
+            size += 2 * (size_t)commands[i].x2 * sizeof(int32_t);
+        }
+    }
+
+    fd = gnuplotd_shm_create(size);
+    if (fd < 0) {
+        goto done;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        fd = -1;
+        goto done;
+    }
+
+    header = (gnuplotd_commands_header_t *)map;
+    header->count = count;
+    header->width = width;
+    header->height = height;
+    header->reserved = 0;
+
+    records = (gnuplotd_command_t *)(header + 1);
+    offset = sizeof(gnuplotd_commands_header_t) + (size_t)count * sizeof(gnuplotd_command_t);
+    for (i = 0; i < count; i++) {
+        gnuplotd_command_t *rec = &records[i];
+
+        memset(rec, 0, sizeof(*rec));
+        rec->type = commands[i].type;
+        rec->x1 = commands[i].x1;
+        rec->y1 = commands[i].y1;
+        rec->x2 = commands[i].x2;
+        rec->y2 = commands[i].y2;
+        rec->color = commands[i].color;
+        rec->value = commands[i].value;
+
+        if (commands[i].text) {
+            size_t len = strlen(commands[i].text) + 1;
+            memcpy(map + offset, commands[i].text, len);
+            rec->text_offset = offset;
+            offset += len;
+        }
+        if (commands[i].image) {
+            luacmd_image_t *image = commands[i].image;
+            size_t len = (size_t)image->width * image->height * 4;
+            offset = (offset + 7) & ~(size_t)7;
+            memcpy(map + offset, image->rgba, len);
+            rec->image_offset = offset;
+            rec->image_width = image->width;
+            rec->image_height = image->height;
+            offset += len;
+        }
+        if (commands[i].points) {
+            int32_t *xy;
+            int k;
+
+            offset = (offset + 7) & ~(size_t)7;
+            xy = (int32_t *)(map + offset);
+            for (k = 0; k < 2 * commands[i].x2; k++) {
+                xy[k] = commands[i].points[k];
+            }
+            rec->points_offset = offset;
+            offset += 2 * (size_t)commands[i].x2 * sizeof(int32_t);
+        }
+    }
+
+    munmap(map, size);
+    *frame_size = size;
+
+done:
+    for (i = 0; i < count; i++) {
+        if (commands[i].text) {
+            free(commands[i].text);
+        }
+        luacmd_image_release(commands[i].image);
+        free(commands[i].points);
+    }
+    free(commands);
+    return fd;
+}
+
+/* Copy the saved PBM bitmap into an RGB frame */
+static int
+write_rgb_frame(uint64_t *frame_size)
+{
+    unsigned int *saved = (unsigned int *)gnuplot_get_saved_pbm_rgb_data();
+    gnuplotd_rgb_header_t *header;
+    size_t rgb_size, size;
+    void *map;
+    int fd;
+
+    if (!saved) {
+        return -1;
+    }
+
+    rgb_size = (size_t)saved[0] * saved[1] * 3;
+    size = sizeof(gnuplotd_rgb_header_t) + rgb_size;
+
+    fd = gnuplotd_shm_create(size);
+    if (fd < 0) {
+        return -1;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    header = (gnuplotd_rgb_header_t *)map;
+    header->width = saved[0];
+    header->height = saved[1];
+    memcpy(header + 1, saved + 2, rgb_size);
+    munmap(map, size);
+
+    /* Do not keep the bitmap around between jobs */
+    gnuplot_free_saved_pbm_bitmap();
+
+    *frame_size = size;
+    return fd;
+}
+
+/* Job timer: the first expiry cancels the running script; if it is still
+ * running a grace period later it never reaches a cancellation point, so
+ * the worker exits and the main process answers for its jobs */
+static volatile sig_atomic_t job_overdue = 0;
+
+static void
+on_job_timer(int sig)
+{
+    (void) sig;
+    if (job_overdue++) {
+        _exit(3);
+    }
+    gnuplot_cancel();
+}
+
+static void
+set_job_timer(unsigned int timeout_ms)
+{
+    struct itimerval it;
+
+    memset(&it, 0, sizeof(it));
+    if (timeout_ms) {
+        it.it_value.tv_sec = timeout_ms / 1000;
+        it.it_value.tv_usec = (timeout_ms % 1000) * 1000;
+        it.it_interval.tv_sec = JOB_GRACE_MS / 1000;
+        it.it_interval.tv_usec = (JOB_GRACE_MS % 1000) * 1000;
+    }
+    setitimer(ITIMER_REAL, &it, NULL);
+    job_overdue = 0;
+}
+
+/* Run one job and reply to its client */
+static void
+run_job(const gnuplotd_request_t *request, int script_fd, int client_fd)
+{
+    gnuplotd_reply_t reply;
+    char setup[256];
+    void *script;
+    unsigned int timeout_ms;
+    int frame_fd = -1;
+    int result;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.magic = GNUPLOTD_MAGIC;
+    reply.id = request->id;
+    reply.status = GNUPLOTD_ERR_SERVER;
+    reply.output = request->output;
+
+    script = mmap(NULL, (size_t)request->script_len, PROT_READ, MAP_PRIVATE, script_fd, 0);
+    if (script != MAP_FAILED) {
+        /* Every job starts from the same configuration */
+        gnuplot_reset();
+        luacmd_clear_commands();
+        gnuplot_free_saved_pbm_bitmap();
+
+        if (request->output == GNUPLOTD_OUTPUT_RGB) {
+            snprintf(setup, sizeof(setup),
+                     "set terminal pbm color size %u,%u\nset output '/dev/null'\n",
+                     request->width, request->height);
+        } else {
+            snprintf(setup, sizeof(setup), "set terminal luacmd size %u,%u\n",
+                     request->width, request->height);
+        }
+
+        /* The client's deadline, capped by the daemon's */
+        timeout_ms = request->timeout_ms;
+        if (job_timeout_ms && (!timeout_ms || timeout_ms > job_timeout_ms)) {
+            timeout_ms = job_timeout_ms;
+        }
+
+        if (gnuplot_run_script(setup, strlen(setup)) != 0) {
+            reply.status = GNUPLOTD_ERR_SERVER;
+        } else {
+            set_job_timer(timeout_ms);
+            result = gnuplot_run_script((const char *)script, (size_t)request->script_len);
+            set_job_timer(0);
+
+            if (result == GNUPLOT_CANCELLED) {
+                reply.status = GNUPLOTD_ERR_TIMEOUT;
+            } else if (result != 0) {
+                reply.status = GNUPLOTD_ERR_SCRIPT;
+            } else {
+                if (request->output == GNUPLOTD_OUTPUT_RGB) {
+                    frame_fd = write_rgb_frame(&reply.frame_size);
+                } else {
+                    frame_fd = write_commands_frame(&reply.frame_size);
+                }
+                reply.status = (frame_fd >= 0) ? GNUPLOTD_OK : GNUPLOTD_ERR_SERVER;
+            }
+        }
+
+        /* Commands are in the frame now */
+        luacmd_clear_commands();
+        munmap(script, (size_t)request->script_len);
+    }
+
+    /* The client may have gone away; nothing to do about that */
+    gnuplotd_send(client_fd, &reply, sizeof(reply), &frame_fd, frame_fd >= 0 ? 1 : 0);
+
+    if (frame_fd >= 0) {
+        close(frame_fd);
+    }
+}
+
+/* Worker process main loop */
+static void
+worker_main(int ctl)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_job_timer;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+
+    if (gnuplot_init() != 0) {
+        fprintf(stderr, "gnuplotd: worker %ld failed to initialize gnuplot\n", (long)getpid());
+        _exit(1);
+    }
+
+    for (;;) {
+        gnuplotd_request_t request;
+        int fds[2];
+        int got = gnuplotd_recv(ctl, &request, sizeof(request), fds, 2);
+
+        if (got <= 0) {
+            break;  /* Parent went away */
+        }
+
+        if (got == (int)sizeof(request) && fds[0] >= 0 && fds[1] >= 0) {
+            run_job(&request, fds[0], fds[1]);
+        }
+
+        if (fds[0] >= 0) close(fds[0]);
+        if (fds[1] >= 0) close(fds[1]);
+
+        /* Report completion */
+        if (gnuplotd_send(ctl, &request.id, sizeof(request.id), NULL, 0) != 0) {
+            break;
+        }
+    }
+
+    gnuplot_close();
+    _exit(0);
+}
+
+/* ------------------------------------------------------------------ */
+/* Main process                                                        */
+/* ------------------------------------------------------------------ */
+
+/* Start (or restart) worker i */
+static int
+start_worker(int i)
+{
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        return -1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        int j;
+
+        /* Child keeps only its end of the control socket */
+        close(sv[0]);
+        for (j = 0; j < client_count; j++) {
+            close(clients[j]);
+        }
+        for (j = 0; j < worker_count; j++) {
+            if (j != i && workers[j].fd >= 0) {
+                close(workers[j].fd);
+            }
+        }
+        worker_main(sv[1]);
+    }
+
+    close(sv[1]);
+    workers[i].pid = pid;
+    workers[i].fd = sv[0];
+    workers[i].pending = 0;
+    return 0;
+}
+
+/* Does job a run before job b? */
+static int
+job_before(const job_t *a, const job_t *b)
+{
+    if (a->request.priority != b->request.priority) {
+        return a->request.priority > b->request.priority;
+    }
+    return a->seq < b->seq;
+}
+
+static void
+queue_sift_up(int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        job_t tmp;
+
+        if (!job_before(&queue[i], &queue[parent])) {
+            break;
+        }
+        tmp = queue[i];
+        queue[i] = queue[parent];
+        queue[parent] = tmp;
+        i = parent;
+    }
+}
+
+static void
+queue_sift_down(int i)
+{
+    for (;;) {
+        int first = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        job_t tmp;
+
+        if (left < queue_count && job_before(&queue[left], &queue[first])) {
+            first = left;
+        }
+        if (right < queue_count && job_before(&queue[right], &queue[first])) {
+            first = right;
+        }
+        if (first == i) {
+            break;
+        }
+        tmp = queue[i];
+        queue[i] = queue[first];
+        queue[first] = tmp;
+        i = first;
+    }
+}
+
+static int
+queue_push(const job_t *job)
+{
+    if (queue_count >= queue_size) {
+        int new_size = (queue_size == 0) ? 64 : queue_size * 2;
+        job_t *grown = (job_t *)realloc(queue, new_size * sizeof(job_t));
+        if (!grown) {
+            return -1;
+        }
+        queue = grown;
+        queue_size = new_size;
+    }
+
+    queue[queue_count] = *job;
+    queue_sift_up(queue_count++);
+    return 0;
+}
+
+static job_t
+queue_pop(void)
+{
+    job_t top = queue[0];
+
+    queue[0] = queue[--queue_count];
+    queue_sift_down(0);
+    return top;
+}
+
+/* Drop queued jobs of a client that disconnected */
+static void
+queue_drop_client(int client_fd)
+{
+    int i, kept = 0;
+
+    for (i = 0; i < queue_count; i++) {
+        if (queue[i].client_fd == client_fd) {
+            close(queue[i].script_fd);
+        } else {
+            queue[kept++] = queue[i];
+        }
+    }
+    queue_count = kept;
+
+    for (i = queue_count / 2 - 1; i >= 0; i--) {
+        queue_sift_down(i);
+    }
+}
+
+/* Reply with an error from the main process */
+static void
+reply_error(int client_fd, uint32_t id, uint32_t output, int status)
+{
+    gnuplotd_reply_t reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.magic = GNUPLOTD_MAGIC;
+    reply.id = id;
+    reply.status = status;
+    reply.output = output;
+    gnuplotd_send(client_fd, &reply, sizeof(reply), NULL, 0);
+}
+
+/* Reply to a request the main process rejects itself */
+static void
+reject_request(int client_fd, const gnuplotd_request_t *request)
+{
+    reply_error(client_fd, request->id, request->output, GNUPLOTD_ERR_REQUEST);
+}
+
+static void
+remove_client(int index)
+{
+    int i, j;
+
+    /* Jobs a worker holds for it finish without anyone to answer */
+    for (i = 0; i < worker_count; i++) {
+        for (j = 0; j < workers[i].pending; j++) {
+            if (workers[i].held[j].client_fd == clients[index]) {
+                workers[i].held[j].client_fd = -1;
+            }
+        }
+    }
+
+    queue_drop_client(clients[index]);
+    close(clients[index]);
+    clients[index] = clients[--client_count];
+}
+
+/* A worker finished the job with this id */
+static void
+worker_job_done(worker_t *worker, uint32_t id)
+{
+    int i;
+
+    /* Jobs complete in order; search in case a client reused an id */
+    for (i = 0; i < worker->pending; i++) {
+        if (worker->held[i].id == id) {
+            break;
+        }
+    }
+    if (i == worker->pending) {
+        return;
+    }
+
+    memmove(&worker->held[i], &worker->held[i + 1],
+            (worker->pending - i - 1) * sizeof(held_job_t));
+    worker->pending--;
+}
+
+/* A worker died: answer the clients of the jobs it held */
+static void
+worker_lost(worker_t *worker)
+{
+    int i;
+
+    for (i = 0; i < worker->pending; i++) {
+        held_job_t *job = &worker->held[i];
+
+        if (job->client_fd >= 0) {
+            reply_error(job->client_fd, job->id, job->output, GNUPLOTD_ERR_SERVER);
+        }
+    }
+    worker->pending = 0;
+}
+
+/* Read one request from a client; returns -1 if the client is gone */
+static int
+read_request(int client_fd)
+{
+    gnuplotd_request_t request;
+    struct stat st;
+    job_t job;
+    int script_fd;
+    int got = gnuplotd_recv(client_fd, &request, sizeof(request), &script_fd, 1);
+
+    if (got <= 0) {
+        return -1;
+    }
+
+    if (got != (int)sizeof(request) || request.magic != GNUPLOTD_MAGIC ||
+        request.output > GNUPLOTD_OUTPUT_RGB ||
+        request.width == 0 || request.width > MAX_CANVAS ||
+        request.height == 0 || request.height > MAX_CANVAS ||
+        request.script_len == 0 || script_fd < 0 ||
+        fstat(script_fd, &st) != 0 || (uint64_t)st.st_size < request.script_len) {
+        if (got == (int)sizeof(request)) {
+            reject_request(client_fd, &request);
+        }
+        if (script_fd >= 0) {
+            close(script_fd);
+        }
+        return 0;
+    }
+
+    job.request = request;
+    job.script_fd = script_fd;
+    job.client_fd = client_fd;
+    job.seq = next_seq++;
+    if (queue_push(&job) != 0) {
+        reject_request(client_fd, &request);
+        close(script_fd);
+    }
+    return 0;
+}
+
+/* Hand queued jobs to idle workers */
+static void
+dispatch(void)
+{
+    int i;
+
+    for (i = 0; i < worker_count && queue_count > 0; i++) {
+        if (workers[i].fd < 0 || workers[i].pending > 0) {
+            continue;
+        }
+
+        while (queue_count > 0 && workers[i].pending < batch_size) {
+            job_t job = queue_pop();
+            int fds[2];
+
+            fds[0] = job.script_fd;
+            fds[1] = job.client_fd;
+            if (gnuplotd_send(workers[i].fd, &job.request, sizeof(job.request), fds, 2) == 0) {
+                held_job_t *held = &workers[i].held[workers[i].pending++];
+
+                held->id = job.request.id;
+                held->output = job.request.output;
+                held->client_fd = job.client_fd;
+            } else {
+                reject_request(job.client_fd, &job.request);
+            }
+            close(job.script_fd);
+        }
+    }
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: gnuplotd [-s socket_path] [-w workers] [-b batch] [-t timeout_ms]\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *socket_path = gnuplotd_default_socket();
+    struct sockaddr_un addr;
+    struct pollfd *pfds;
+    mode_t old_mask;
+    int listen_fd;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "s:w:b:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'w':
+            worker_count = atoi(optarg);
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            break;
+        case 't':
+            job_timeout_ms = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (worker_count < 1 || worker_count > MAX_WORKERS ||
+        batch_size < 1 || batch_size > MAX_BATCH ||
+        strlen(socket_path) >= sizeof(addr.sun_path)) {
+        usage();
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("gnuplotd: socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    /* Only this user may connect; the socket is never world-accessible,
+     * not even between bind() and chmod() */
+    old_mask = umask(0077);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(socket_path, 0600) != 0 ||
+        listen(listen_fd, 64) != 0) {
+        perror("gnuplotd: bind");
+        return 1;
+    }
+    umask(old_mask);
+
+    for (i = 0; i < worker_count; i++) {
+        workers[i].fd = -1;
+    }
+    for (i = 0; i < worker_count; i++) {
+        if (start_worker(i) != 0) {
+            perror("gnuplotd: fork");
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "gnuplotd: listening on %s with %d workers\n", socket_path, worker_count);
+
+    pfds = (struct pollfd *)malloc((1 + MAX_WORKERS + MAX_CLIENTS) * sizeof(struct pollfd));
+    if (!pfds) {
+        return 1;
+    }
+
+    while (!stop_requested) {
+        int n = 0;
+
+        pfds[n].fd = listen_fd;
+        pfds[n++].events = (client_count < MAX_CLIENTS) ? POLLIN : 0;
+        for (i = 0; i < worker_count; i++) {
+            pfds[n].fd = workers[i].fd;
+            pfds[n++].events = POLLIN;
+        }
+        for (i = 0; i < client_count; i++) {
+            pfds[n].fd = clients[i];
+            pfds[n++].events = POLLIN;
+        }
+
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("gnuplotd: poll");
+            break;
+        }
+
+        /* Worker completions (and crashes) */
+        for (i = 0; i < worker_count; i++) {
+            short re = pfds[1 + i].revents;
+            uint32_t id;
+            int dummy;
+
+            if (!re) {
+                continue;
+            }
+            if ((re & POLLIN) &&
+                gnuplotd_recv(workers[i].fd, &id, sizeof(id), &dummy, 0) > 0) {
+                worker_job_done(&workers[i], id);
+            } else if (re & (POLLHUP | POLLERR | POLLIN)) {
+                /* Worker died; fail the jobs it held and replace it */
+                fprintf(stderr, "gnuplotd: worker %ld exited, restarting\n", (long)workers[i].pid);
+                worker_lost(&workers[i]);
+                close(workers[i].fd);
+                waitpid(workers[i].pid, NULL, 0);
+                workers[i].fd = -1;
+                if (start_worker(i) != 0) {
+                    perror("gnuplotd: fork");
+                }
+            }
+        }
+
+        /* Client requests; iterate backwards so removal is safe */
+        for (i = client_count - 1; i >= 0; i--) {
+            short re = pfds[1 + worker_count + i].revents;
+
+            if (re & (POLLIN | POLLHUP | POLLERR)) {
+                if (read_request(clients[i]) != 0) {
+                    remove_client(i);
+                }
+            }
+        }
+
+        /* New connections */
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0 && gnuplotd_check_peer(fd) != 0) {
+                close(fd);  /* Another user */
+            } else if (fd >= 0) {
+                clients[client_count++] = fd;
+            }
+        }
+
+        dispatch();
+    }
+
+    /* Shut down: closing the control sockets ends the workers */
+    for (i = 0; i < worker_count; i++) {
+        if (workers[i].fd >= 0) {
+            close(workers[i].fd);
+            waitpid(workers[i].pid, NULL, 0);
+        }
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    free(pfds);
+    free(queue);
+    return 0;
+}
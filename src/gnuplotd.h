@@ -0,0 +1,113 @@
+/* GNUPLOT - gnuplotd.h */
+
+/*
+ * Wire protocol of the gnuplotd render daemon
+ *
+ * Clients talk to the daemon over a UNIX domain SOCK_SEQPACKET socket.
+ * Neither scripts nor results travel through the socket itself: the
+ * client writes its script into a shared memory file and attaches the
+ * descriptor to the request, and the daemon answers with a descriptor
+ * for a shared memory file holding the frame.
+ *
+ *   request:  gnuplotd_request_t  + SCM_RIGHTS { script fd }
+ *   reply:    gnuplotd_reply_t    + SCM_RIGHTS { frame fd }  (status 0 only)
+ */
+
+#ifndef GNUPLOTD_H
+#define GNUPLOTD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GNUPLOTD_MAGIC           0x32445047u  /* "GPD2" */
+#define GNUPLOTD_SOCKET_NAME     "gnuplotd.sock"  /* In $XDG_RUNTIME_DIR */
+
+/* What the daemon renders */
+#define GNUPLOTD_OUTPUT_COMMANDS 0  /* luacmd command stream */
+#define GNUPLOTD_OUTPUT_RGB      1  /* RGB frame from 'set terminal pbm color' */
+
+/* Reply status */
+#define GNUPLOTD_OK              0
+#define GNUPLOTD_ERR_SCRIPT     -1  /* The script failed */
+#define GNUPLOTD_ERR_REQUEST    -2  /* Malformed request */
+#define GNUPLOTD_ERR_SERVER     -3  /* Daemon could not produce the frame */
+#define GNUPLOTD_ERR_TIMEOUT    -4  /* The job ran past its deadline */
+
+/* Client -> daemon */
+typedef struct {
+    uint32_t magic;
+    uint32_t id;            /* Chosen by the client, echoed in the reply */
+    int32_t priority;       /* Higher priorities are served first */
+    uint32_t output;        /* GNUPLOTD_OUTPUT_* */
+    uint32_t width, height; /* Canvas size in pixels */
+    uint32_t timeout_ms;    /* Job deadline, 0 = the daemon's default */
+    uint32_t reserved;
+    uint64_t script_len;    /* Bytes of script in the attached file */
+} gnuplotd_request_t;
+
+/* Daemon -> client */
+typedef struct {
+    uint32_t magic;
+    uint32_t id;
+    int32_t status;         /* GNUPLOTD_OK or GNUPLOTD_ERR_* */
+    uint32_t output;
+    uint64_t frame_size;    /* Bytes in the attached frame file */
+} gnuplotd_reply_t;
+
+/* RGB frame: header followed by width * height * 3 bytes */
+typedef struct {
+    uint32_t width, height;
+} gnuplotd_rgb_header_t;
+
+/* Command frame: header, count records, then text, pixel and polygon
+ * data referenced by offsets from the start of the frame */
+typedef struct {
+    uint32_t count;
+    uint32_t width, height;
+    uint32_t reserved;
+} gnuplotd_commands_header_t;
+
+typedef struct {
+    int32_t type;           /* luacmd command type */
+    int32_t x1, y1;
+    int32_t x2, y2;
+    uint32_t color;
+    double value;
+    uint64_t text_offset;   /* NUL-terminated text, 0 = none */
+    uint64_t image_offset;  /* RGBA pixels, 0 = none */
+    uint32_t image_width, image_height;
+    uint64_t points_offset; /* x2 int32 x, y pairs, 0 = none */
+} gnuplotd_command_t;
+
+/* Transport helpers shared by the daemon and the client library
+ * (implemented in gnuplotd_client.c) */
+
+/* Default socket path: $XDG_RUNTIME_DIR/gnuplotd.sock, or a per-user
+ * name in /tmp when there is no runtime directory */
+const char *gnuplotd_default_socket(void);
+
+/* Check that the process on the other end of sock runs as this user
+ * Returns 0 if it does, -1 otherwise */
+int gnuplotd_check_peer(int sock);
+
+/* Create an anonymous shared memory file of the given size
+ * Returns a descriptor or -1 */
+int gnuplotd_shm_create(size_t size);
+
+/* Send one message with up to 2 descriptors attached
+ * Returns 0 on success, -1 on error */
+int gnuplotd_send(int sock, const void *msg, size_t len, const int *fds, int nfds);
+
+/* Receive one message and its descriptors (unused slots are set to -1)
+ * Returns the message length, 0 when the peer closed, -1 on error */
+int gnuplotd_recv(int sock, void *msg, size_t len, int *fds, int maxfds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GNUPLOTD_H */
@@ -0,0 +1,413 @@
+/* GNUPLOT - gnuplotd_client.c */
+
+/*
+ * Client library and shared transport helpers for the gnuplotd daemon
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "gnuplotd_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Default socket path */
+const char *gnuplotd_default_socket(void)
+{
+    static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    if (dir && *dir && strlen(dir) + 1 + strlen(GNUPLOTD_SOCKET_NAME) < sizeof(path)) {
+        snprintf(path, sizeof(path), "%s/%s", dir, GNUPLOTD_SOCKET_NAME);
+    } else {
+        /* Both ends check the peer's user, see gnuplotd_check_peer() */
+        snprintf(path, sizeof(path), "/tmp/gnuplotd-%ld.sock", (long)geteuid());
+    }
+    return path;
+}
+
+/* Check the peer's user */
+int gnuplotd_check_peer(int sock)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        return -1;
+    }
+    return (cred.uid == geteuid()) ? 0 : -1;
+#else
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(sock, &uid, &gid) != 0) {
+        return -1;
+    }
+    return (uid == geteuid()) ? 0 : -1;
+#endif
+}
+
+/* Create an anonymous shared memory file */
+int gnuplotd_shm_create(size_t size)
+{
+    int fd;
+
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("gnuplotd", MFD_CLOEXEC);
+#else
+    /* No memfd: use a POSIX shared memory object that is unlinked at once */
+    char name[64];
+    static unsigned int counter = 0;
+
+    snprintf(name, sizeof(name), "/gnuplotd-%ld-%u", (long)getpid(), counter++);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(name);
+    }
+#endif
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Send one message with descriptors attached */
+int gnuplotd_send(int sock, const void *msg, size_t len, const int *fds, int nfds)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    ssize_t sent;
+
+    if (nfds < 0 || nfds > 2) {
+        return -1;
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = (void *)msg;
+    iov.iov_len = len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (nfds > 0) {
+        struct cmsghdr *cm;
+
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+
+    do {
+        sent = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    return (sent == (ssize_t)len) ? 0 : -1;
+}
+
+/* Receive one message and its descriptors */
+int gnuplotd_recv(int sock, void *msg, size_t len, int *fds, int maxfds)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+    ssize_t got;
+    int i;
+
+    for (i = 0; i < maxfds; i++) {
+        fds[i] = -1;
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = msg;
+    iov.iov_len = len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    do {
+        got = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+
+    if (got <= 0) {
+        return (int)got;
+    }
+
+    for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            int n = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            int received[4];
+
+            if (n > 4) {
+                n = 4;
+            }
+            memcpy(received, CMSG_DATA(cm), n * sizeof(int));
+            for (i = 0; i < n; i++) {
+                if (i < maxfds) {
+                    fds[i] = received[i];
+                } else {
+                    close(received[i]);  /* More than the caller expects */
+                }
+            }
+        }
+    }
+
+    /* A truncated message is a protocol error */
+    if (mh.msg_flags & MSG_TRUNC) {
+        for (i = 0; i < maxfds; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+        return -1;
+    }
+
+    return (int)got;
+}
+
+/* Connect to a daemon */
+int gnuplotd_connect(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    int conn;
+
+    if (!socket_path) {
+        socket_path = gnuplotd_default_socket();
+    }
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    /* Scripts must not go to a socket someone else put at the path */
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        gnuplotd_check_peer(conn) != 0 ||
+        gnuplotd_set_timeout(conn, GNUPLOTD_DEFAULT_TIMEOUT_MS) != 0) {
+        close(conn);
+        return -1;
+    }
+
+    return conn;
+}
+
+/* Set how long gnuplotd_render() waits for a reply */
+int gnuplotd_set_timeout(int conn, unsigned int timeout_ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    return setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/* Close a connection */
+void gnuplotd_disconnect(int conn)
+{
+    if (conn >= 0) {
+        close(conn);
+    }
+}
+
+/* Render a script and wait for the frame */
+int gnuplotd_render(int conn, const char *script, size_t len, int output,
+                    unsigned int width, unsigned int height, int priority,
+                    gnuplotd_frame_t *frame)
+{
+    static uint32_t next_id = 0;
+    gnuplotd_request_t request;
+    gnuplotd_reply_t reply;
+    struct timeval tv;
+    socklen_t tv_len = sizeof(tv);
+    const char *p;
+    size_t left;
+    int script_fd;
+    int frame_fd;
+    int result;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->status = GNUPLOTD_ERR_SERVER;
+
+    /* Hand the script over through shared memory */
+    script_fd = gnuplotd_shm_create(len);
+    if (script_fd < 0) {
+        return -1;
+    }
+    for (p = script, left = len; left > 0; ) {
+        ssize_t n = write(script_fd, p, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close(script_fd);
+            return -1;
+        }
+        p += n;
+        left -= n;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.magic = GNUPLOTD_MAGIC;
+    request.id = ++next_id;
+    request.priority = priority;
+    request.output = output;
+    request.width = width;
+    request.height = height;
+    request.script_len = len;
+
+    /* The job is not worth running for longer than we wait for it */
+    if (getsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, &tv_len) == 0) {
+        request.timeout_ms = (uint32_t)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+    }
+
+    result = gnuplotd_send(conn, &request, sizeof(request), &script_fd, 1);
+    close(script_fd);
+    if (result != 0) {
+        return -1;
+    }
+
+    /* Wait for our reply, dropping stale ones from abandoned requests */
+    for (;;) {
+        int got = gnuplotd_recv(conn, &reply, sizeof(reply), &frame_fd, 1);
+
+        /* The connection stays usable: a late reply is dropped as stale */
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            frame->status = GNUPLOTD_ERR_TIMEOUT;
+            return 0;
+        }
+        if (got != (int)sizeof(reply) || reply.magic != GNUPLOTD_MAGIC) {
+            if (frame_fd >= 0) {
+                close(frame_fd);
+            }
+            return -1;
+        }
+        if (reply.id == request.id) {
+            break;
+        }
+        if (frame_fd >= 0) {
+            close(frame_fd);
+        }
+    }
+
+    frame->status = reply.status;
+    frame->output = (int)reply.output;
+
+    if (reply.status == GNUPLOTD_OK) {
+        if (frame_fd < 0 || reply.frame_size == 0) {
+            frame->status = GNUPLOTD_ERR_SERVER;
+        } else {
+            frame->data = mmap(NULL, (size_t)reply.frame_size, PROT_READ,
+                               MAP_SHARED, frame_fd, 0);
+            if (frame->data == MAP_FAILED) {
+                frame->data = NULL;
+                frame->status = GNUPLOTD_ERR_SERVER;
+            } else {
+                frame->size = (size_t)reply.frame_size;
+            }
+        }
+    }
+
+    if (frame_fd >= 0) {
+        close(frame_fd);
+    }
+    return 0;
+}
+
+/* Unmap a frame */
+void gnuplotd_frame_release(gnuplotd_frame_t *frame)
+{
+    if (frame && frame->data) {
+        munmap(frame->data, frame->size);
+        frame->data = NULL;
+        frame->size = 0;
+    }
+}
+
+/* Access a command frame */
+const gnuplotd_command_t *gnuplotd_frame_commands(const gnuplotd_frame_t *frame,
+                                                  unsigned int *count,
+                                                  unsigned int *width,
+                                                  unsigned int *height)
+{
+    const gnuplotd_commands_header_t *header;
+
+    if (!frame->data || frame->output != GNUPLOTD_OUTPUT_COMMANDS ||
+        frame->size < sizeof(*header)) {
+        return NULL;
+    }
+
+    header = (const gnuplotd_commands_header_t *)frame->data;
+    if (sizeof(*header) + (size_t)header->count * sizeof(gnuplotd_command_t) > frame->size) {
+        return NULL;
+    }
+
+    *count = header->count;
+    *width = header->width;
+    *height = header->height;
+    return (const gnuplotd_command_t *)(header + 1);
+}
+
+/* Access an RGB frame */
+const unsigned char *gnuplotd_frame_rgb(const gnuplotd_frame_t *frame,
+                                        unsigned int *width,
+                                        unsigned int *height)
+{
+    const gnuplotd_rgb_header_t *header;
+
+    if (!frame->data || frame->output != GNUPLOTD_OUTPUT_RGB ||
+        frame->size < sizeof(*header)) {
+        return NULL;
+    }
+
+    header = (const gnuplotd_rgb_header_t *)frame->data;
+    if (sizeof(*header) + (size_t)header->width * header->height * 3 > frame->size) {
+        return NULL;
+    }
+
+    *width = header->width;
+    *height = header->height;
+    return (const unsigned char *)(header + 1);
+}
@@ -0,0 +1,73 @@
+/* GNUPLOT - gnuplotd_client.h */
+
+/*
+ * Client library for the gnuplotd render daemon
+ * Renders gnuplot scripts in a warm daemon process instead of embedding
+ * and initializing libgnuplot in every process.
+ */
+
+#ifndef GNUPLOTD_CLIENT_H
+#define GNUPLOTD_CLIENT_H
+
+#include "gnuplotd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A rendered frame, mapped read-only from the daemon's shared memory */
+typedef struct {
+    int status;       /* GNUPLOTD_OK or GNUPLOTD_ERR_* */
+    int output;       /* GNUPLOTD_OUTPUT_* */
+    void *data;       /* Frame contents, NULL unless status is GNUPLOTD_OK */
+    size_t size;
+} gnuplotd_frame_t;
+
+/* Default time gnuplotd_render() waits for a reply */
+#define GNUPLOTD_DEFAULT_TIMEOUT_MS 60000
+
+/* Connect to a daemon (socket_path NULL = gnuplotd_default_socket())
+ * Fails unless the daemon runs as the same user.
+ * Returns a connection descriptor or -1 */
+int gnuplotd_connect(const char *socket_path);
+
+/* Set how long gnuplotd_render() waits for a reply on conn, 0 = forever
+ * The daemon cancels the job once this much time has passed.
+ * Returns 0 on success, -1 on error */
+int gnuplotd_set_timeout(int conn, unsigned int timeout_ms);
+
+/* Close a connection */
+void gnuplotd_disconnect(int conn);
+
+/* Render a script and wait for the frame
+ * The daemon starts every job from a reset configuration with the terminal
+ * selected by output and width/height; the script should not change it.
+ * Returns 0 when a reply was received or the wait timed out (check
+ * frame->status, GNUPLOTD_ERR_TIMEOUT), -1 when the connection failed.
+ * Release the frame with gnuplotd_frame_release().
+ */
+int gnuplotd_render(int conn, const char *script, size_t len, int output,
+                    unsigned int width, unsigned int height, int priority,
+                    gnuplotd_frame_t *frame);
+
+/* Unmap a frame */
+void gnuplotd_frame_release(gnuplotd_frame_t *frame);
+
+/* Access a GNUPLOTD_OUTPUT_COMMANDS frame
+ * Returns the command records, or NULL if the frame is not a command frame */
+const gnuplotd_command_t *gnuplotd_frame_commands(const gnuplotd_frame_t *frame,
+                                                  unsigned int *count,
+                                                  unsigned int *width,
+                                                  unsigned int *height);
+
+/* Access a GNUPLOTD_OUTPUT_RGB frame
+ * Returns width * height * 3 RGB bytes, or NULL if not an RGB frame */
+const unsigned char *gnuplotd_frame_rgb(const gnuplotd_frame_t *frame,
+                                        unsigned int *width,
+                                        unsigned int *height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GNUPLOTD_CLIENT_H */
@@ -23,25 +23,96 @@
 #include "gadgets.h"
 #include "standard.h"
 #include "datablock.h"
+#include "datafile.h"
+#include "parse.h"
+#include "pm3d.h"
+#include "scanner.h"
 
 #include <signal.h>
 #include <setjmp.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#endif
 
 /* Global state */
 static int lib_initialized = 0;
 static JMP_BUF lib_command_line_env;
+static int lib_busy = 0;    /* A command owns lib_command_line_env */
+
+/* Configuration snapshots */
+typedef struct state_datablock {
+    char *name;
+    char **lines;               /* NULL-terminated copy of the data_array */
+    struct state_datablock *next;
+} state_datablock_t;
+
+/* The lines of a save_set() script, comments left out. A line ending in
+ * a backslash and its continuation count as one line. */
+typedef struct {
+    char *text;                 /* The lines, each NUL-terminated */
+    char **line;                /* In script order */
+    char **sorted;              /* Sorted, for state_lines_has() */
+    size_t count;
+} state_lines_t;
+
+struct gnuplot_state {
+    state_lines_t settings;     /* Settings that differ from the defaults */
+    char *script;               /* Commands that recreate functions and variables */
+    size_t len;
+    char *term_name;            /* Terminal, set only when it differs */
+    char *term_options;
+    state_datablock_t *datablocks;
+};
+static unsigned long state_generation = 0;  /* Bumped by configuration changes */
+static gnuplot_state_t *active_state = NULL;
+static unsigned long active_generation = 0;
+static state_lines_t state_defaults;        /* Settings right after 'reset' */
 
 /* Terminal text() hooking for auto-saving bitmap */
 static void (*original_term_text)(void) = NULL;
+static struct termentry *hooked_term = NULL;
 static int term_hooked = 0;
+static int term_hook_persistent = 0;  /* Stay hooked across plots (scripts) */
+
+/* Cooperative cancellation
+ * Each cancellable command gets a generation number, and a request names
+ * the generation it was made during. A request made between commands, or
+ * for a command that has finished, names no running command and is
+ * ignored instead of stopping the next one. */
+static volatile sig_atomic_t cancel_generation = 0;  /* Running command, 0 = none */
+static volatile sig_atomic_t cancel_requested = 0;   /* Generation to cancel */
+static int cancel_last_generation = 0;
+static volatile sig_atomic_t cancel_interrupted = 0;  /* Set by SIGINT */
+static int cancel_armed = 0;        /* A command is running and may be unwound */
+static int cancel_unwound = 0;      /* The last command was cancelled */
+static double cancel_deadline = 0;  /* Monotonic ms, 0 = none */
+static unsigned int cancel_polls = 0;
+static struct termentry *cancel_term = NULL;
+static struct termentry cancel_saved;  /* Callbacks replaced on cancel_term */
 
 /* Forward declarations */
 static void init_memory_lib(void);
 static void hook_terminal_text(void);
 static void unhook_terminal_text(void);
 static void wrapped_term_text(void);
+static void mem_after_command(void);
+static int state_capture_settings(state_lines_t *lines);
+static void state_lines_free(state_lines_t *lines);
+#ifndef _WIN32
+static void dataset_remove_stale(void);
+#endif
 
 /* External variables and functions from gnuplot */
 extern struct termentry *term;
@@ -60,6 +131,273 @@ extern void extend_token_table(void);
 extern struct udvt_entry *add_udv_by_name(char *);
 extern struct udvt_entry *get_udv_by_name(char *);
 
+/* Memory accounting */
+static gnuplot_mem_usage_t mem_usage[GNUPLOT_MEM_COUNT];
+static int mem_trim_enabled = 0;
+static int mem_vars_stale = 1;  /* Datablock/UDV totals need a rescan */
+
+/* Record the current size of a subsystem */
+static void mem_note(int subsystem, size_t current)
+{
+    mem_usage[subsystem].current = current;
+    if (current > mem_usage[subsystem].high_water) {
+        mem_usage[subsystem].high_water = current;
+    }
+}
+
+/* Bytes held by one datablock: line text plus the line pointer array */
+static size_t datablock_bytes(struct value *datablock)
+{
+    size_t bytes;
+    char **line;
+
+    if (datablock->type != DATABLOCK || !datablock->v.data_array) {
+        return 0;
+    }
+
+    bytes = sizeof(char *);  /* NULL terminator */
+    for (line = datablock->v.data_array; *line; line++) {
+        bytes += strlen(*line) + 1 + sizeof(char *);
+    }
+    return bytes;
+}
+
+/* Number of elements of an ARRAY value
+ * gnuplot allocates size + 1 values and keeps the size in the int_val of
+ * element 0 (array_command() in command.c); the elements are 1..size.
+ * Element 0's type only tags colormap arrays, so it is not checked. */
+static int udv_array_size(struct value *array)
+{
+    int size = (int)array->v.value_array[0].v.int_val;
+
+    return (size > 0) ? size : 0;
+}
+
+/* Bytes held by a string or array variable */
+static size_t udv_value_bytes(struct value *v)
+{
+    size_t bytes = 0;
+
+    if (v->type == STRING && v->v.string_val) {
+        bytes = strlen(v->v.string_val) + 1;
+    } else if (v->type == ARRAY && v->v.value_array) {
+        int size = udv_array_size(v);
+        bytes = (size + 1) * sizeof(struct value);
+        for (int i = 1; i <= size; i++) {
+            struct value *elem = &v->v.value_array[i];
+            if (elem->type == STRING && elem->v.string_val) {
+                bytes += strlen(elem->v.string_val) + 1;
+            }
+        }
+    }
+    return bytes;
+}
+
+/* Measure datablocks and user variable strings/arrays
+ * Commands change variables without telling us, so they mark the totals
+ * stale and the next reader rescans. gnuplot_set_datablock() keeps the
+ * datablock total current itself instead of rescanning. */
+static void mem_scan_variables(void)
+{
+    struct udvt_entry *udv;
+    size_t blocks = 0;
+    size_t strings = 0;
+
+    for (udv = first_udv; udv; udv = udv->next_udv) {
+        struct value *v = &udv->udv_value;
+
+        if (v->type == DATABLOCK) {
+            blocks += datablock_bytes(v);
+        } else {
+            strings += udv_value_bytes(v);
+        }
+    }
+
+    mem_note(GNUPLOT_MEM_DATABLOCK, blocks);
+    mem_note(GNUPLOT_MEM_UDV, strings);
+    mem_vars_stale = 0;
+}
+
+/* Fail the running command if it left variables over their limits
+ * Runs inside the command's SETJMP, so the command returns -1. What the
+ * command defined is kept; the caller can undefine it. */
+static void mem_check_variables(void)
+{
+    gnuplot_mem_usage_t *blocks = &mem_usage[GNUPLOT_MEM_DATABLOCK];
+    gnuplot_mem_usage_t *strings = &mem_usage[GNUPLOT_MEM_UDV];
+
+    if (!blocks->limit && !strings->limit) {
+        return;
+    }
+
+    mem_scan_variables();
+    if (blocks->limit && blocks->current > blocks->limit) {
+        int_error(NO_CARET, "datablocks hold %lu bytes, over the limit of %lu",
+                  (unsigned long)blocks->current, (unsigned long)blocks->limit);
+    }
+    if (strings->limit && strings->current > strings->limit) {
+        int_error(NO_CARET, "user variables hold %lu bytes, over the limit of %lu",
+                  (unsigned long)strings->current, (unsigned long)strings->limit);
+    }
+}
+
+/* User variable index
+ * gnuplot keeps variables and datablocks in one linked list and resolves
+ * every name with a walk from its head. The index hashes the list entries
+ * by name instead. Global entries are never unlinked or freed: 'undefine'
+ * and 'reset session' only mark them NOTDEFINED, and compiled expressions
+ * keep pointers to them. New globals are appended, so the index only has to
+ * pick up entries added since it last looked, starting after the last
+ * entry it indexed.
+ *
+ * 'local' variables are different: gnuplot pushes them onto the head of the
+ * list so that they shadow globals, and unlinks and frees them when their
+ * load file or function block ends. The index therefore covers only the
+ * list from the entry that headed it when no scope was open; anything in
+ * front of that entry is a local and is searched by a plain walk before
+ * the index is consulted. Nothing that can be freed is ever indexed.
+ */
+static struct udvt_entry **udv_index = NULL;
+static size_t udv_index_size = 0;     /* Slots, a power of two */
+static size_t udv_index_count = 0;
+static struct udvt_entry *udv_index_head = NULL;  /* First global entry */
+static struct udvt_entry *udv_index_tail = NULL;  /* Last indexed entry */
+
+/* FNV-1a */
+static size_t
+udv_hash(const char *name)
+{
+    size_t h = 2166136261u;
+
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Slot holding name, or the free slot where it belongs */
+static size_t
+udv_index_slot(const char *name)
+{
+    size_t mask = udv_index_size - 1;
+    size_t i = udv_hash(name) & mask;
+
+    while (udv_index[i] && strcmp(udv_index[i]->udv_name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void
+udv_index_insert(struct udvt_entry *udv)
+{
+    size_t i;
+
+    /* Keep the load factor at or below 1/2 */
+    if ((udv_index_count + 1) * 2 > udv_index_size) {
+        struct udvt_entry **old = udv_index;
+        size_t old_size = udv_index_size;
+
+        udv_index_size = old_size ? old_size * 2 : 256;
+        udv_index = (struct udvt_entry **)gp_alloc(udv_index_size * sizeof(*udv_index),
+                                                   "variable index");
+        memset(udv_index, 0, udv_index_size * sizeof(*udv_index));
+        for (i = 0; i < old_size; i++) {
+            if (old[i]) {
+                udv_index[udv_index_slot(old[i]->udv_name)] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    /* Like the list walk, the first entry of a name wins */
+    i = udv_index_slot(udv->udv_name);
+    if (!udv_index[i]) {
+        udv_index[i] = udv;
+        udv_index_count++;
+    }
+}
+
+/* Index the entries appended to the list since the last call. The first
+ * call happens during gnuplot_init(), before any scope can be open, so the
+ * head seen then is the first global entry. */
+static void
+udv_index_sync(void)
+{
+    struct udvt_entry *udv;
+
+    if (!udv_index_head) {
+        udv_index_head = first_udv;
+    }
+    udv = udv_index_tail ? udv_index_tail->next_udv : udv_index_head;
+
+    for (; udv; udv = udv->next_udv) {
+        udv_index_insert(udv);
+        udv_index_tail = udv;
+    }
+}
+
+/* Find a variable, defined or not (get_udv_by_name() semantics) */
+static struct udvt_entry *
+udv_find(const char *name)
+{
+    struct udvt_entry *udv;
+
+    udv_index_sync();
+
+    /* Locals in front of the globals shadow them, innermost first */
+    for (udv = first_udv; udv && udv != udv_index_head; udv = udv->next_udv) {
+        if (strcmp(udv->udv_name, name) == 0) {
+            return udv;
+        }
+    }
+    if (!udv || !udv_index) {
+        return NULL;
+    }
+    return udv_index[udv_index_slot(name)];
+}
+
+/* Find or create a variable (add_udv_by_name() semantics) */
+static struct udvt_entry *
+udv_add(const char *name)
+{
+    struct udvt_entry *udv = udv_find(name);
+
+    if (udv) {
+        return udv;
+    }
+
+    /* Append a NOTDEFINED entry, as add_udv_by_name() does; after the
+     * sync above the last indexed entry is the end of the list */
+    udv = (struct udvt_entry *)gp_alloc(sizeof(struct udvt_entry), "value");
+    memset(udv, 0, sizeof(*udv));
+    udv->udv_name = gp_strdup(name);
+    udv->udv_value.type = NOTDEFINED;
+    udv_index_tail->next_udv = udv;
+    udv_index_insert(udv);
+    udv_index_tail = udv;
+    return udv;
+}
+
+#ifdef GNUPLOT_UDV_INDEX
+/* Route gnuplot's own name lookups ($NAME references, variable creation
+ * during parsing, datafile access to datablocks) through the index.
+ * build.sh compiles eval.c with its linear versions renamed to
+ * gp_linear_get_udv_by_name() and gp_linear_add_udv_by_name(). */
+struct udvt_entry *
+get_udv_by_name(char *key)
+{
+    return udv_find(key);
+}
+
+struct udvt_entry *
+add_udv_by_name(char *key)
+{
+    return udv_add(key);
+}
+#endif
+
 /* Signal handler for library mode */
 static RETSIGTYPE
 lib_inter(int anint)
@@ -68,8 +406,15 @@ lib_inter(int anint)
     (void) signal(SIGINT, (sigfunc) lib_inter);
     (void) signal(SIGFPE, SIG_DFL);
 
-    /* In library mode, we don't jump back to command line on interrupt */
-    /* Just reset and return */
+    /* A running command is unwound at its next cancellation point; jumping
+     * out of the signal handler could leave gnuplot's state half updated.
+     * The terminal is reset once the command has been unwound. */
+    if (cancel_armed) {
+        cancel_interrupted = 1;
+        cancel_requested = cancel_generation;
+        return;
+    }
+
     term_reset();
 }
 
@@ -85,8 +430,10 @@ wrapped_term_text(void)
         original_term_text();
     }
 
-    /* Unhook after use (plot is done) */
-    unhook_terminal_text();
+    /* Unhook after use (plot is done) unless a script is running */
+    if (!term_hook_persistent) {
+        unhook_terminal_text();
+    }
 }
 
 /* Hook the terminal's text() function to auto-save bitmap */
@@ -99,6 +446,7 @@ hook_terminal_text(void)
 
     /* Save original function pointer */
     original_term_text = term->text;
+    hooked_term = term;
 
     /* Replace with our wrapper */
     term->text = wrapped_term_text;
@@ -109,19 +457,240 @@ hook_terminal_text(void)
 static void
 unhook_terminal_text(void)
 {
-    if (!term || !term_hooked) {
+    if (!hooked_term || !term_hooked) {
         return;  /* Not hooked */
     }
 
-    /* Restore original function */
+    /* Restore original function on the terminal that was hooked,
+     * which is not necessarily the current one after 'set terminal' */
     if (original_term_text) {
-        term->text = original_term_text;
+        hooked_term->text = original_term_text;
     }
 
     original_term_text = NULL;
+    hooked_term = NULL;
     term_hooked = 0;
 }
 
+/* Milliseconds from a monotonic clock */
+static double
+monotonic_ms(void)
+{
+#ifdef _WIN32
+    /* clock() measures elapsed wall time on Windows */
+    return (double)clock() * 1000.0 / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+/* Unwind a cancelled command back to lib_command_line_env
+ * drawing: cancelled from a drawing callback, with the plot under way */
+static void
+cancel_unwind(int drawing)
+{
+    cancel_armed = 0;
+    cancel_unwound = 1;
+
+    /* Leave the terminal out of graphics mode so the next plot starts clean.
+     * Sampling and data reading happen before the plot starts. */
+    if (drawing) {
+        term_end_plot();
+    }
+
+    /* int_error() resets the reader, parser, iterators, locale and error
+     * state as for any failed command, then jumps to lib_command_line_env */
+    int_error(NO_CARET, "command cancelled");
+}
+
+/* Whether the running command has been cancelled or ran out of time */
+static int
+cancel_due(void)
+{
+    if (!cancel_armed) {
+        return 0;
+    }
+
+    /* Reading the clock is cheap but not free - sample it */
+    if (cancel_requested != cancel_generation && cancel_deadline > 0 &&
+        (++cancel_polls & 0xff) == 0 && monotonic_ms() >= cancel_deadline) {
+        cancel_requested = cancel_generation;
+    }
+
+    return cancel_requested == cancel_generation;
+}
+
+/* Cancellation point, called from drawing callbacks */
+static void
+check_cancel(void)
+{
+    if (cancel_due()) {
+        cancel_unwind(1);
+    }
+}
+
+static void
+cancel_move(unsigned int x, unsigned int y)
+{
+    check_cancel();
+    cancel_saved.move(x, y);
+}
+
+static void
+cancel_vector(unsigned int x, unsigned int y)
+{
+    check_cancel();
+    cancel_saved.vector(x, y);
+}
+
+static void
+cancel_put_text(unsigned int x, unsigned int y, const char *str)
+{
+    check_cancel();
+    cancel_saved.put_text(x, y, str);
+}
+
+static void
+cancel_point(unsigned int x, unsigned int y, int pointstyle)
+{
+    check_cancel();
+    cancel_saved.point(x, y, pointstyle);
+}
+
+static void
+cancel_fillbox(int style, unsigned int x, unsigned int y,
+               unsigned int width, unsigned int height)
+{
+    check_cancel();
+    cancel_saved.fillbox(style, x, y, width, height);
+}
+
+static void
+cancel_filled_polygon(int points, gpiPoint *corners)
+{
+    check_cancel();
+    cancel_saved.filled_polygon(points, corners);
+}
+
+/* Route the current terminal's drawing callbacks through check_cancel() */
+static void
+cancel_hook_term(void)
+{
+    if (!term || cancel_term) {
+        return;
+    }
+
+    cancel_term = term;
+    cancel_saved = *term;
+    if (term->move) term->move = cancel_move;
+    if (term->vector) term->vector = cancel_vector;
+    if (term->put_text) term->put_text = cancel_put_text;
+    if (term->point) term->point = cancel_point;
+    if (term->fillbox) term->fillbox = cancel_fillbox;
+    if (term->filled_polygon) term->filled_polygon = cancel_filled_polygon;
+}
+
+/* Put back the callbacks of the hooked terminal, even after 'set terminal' */
+static void
+cancel_unhook_term(void)
+{
+    if (!cancel_term) {
+        return;
+    }
+
+    cancel_term->move = cancel_saved.move;
+    cancel_term->vector = cancel_saved.vector;
+    cancel_term->put_text = cancel_saved.put_text;
+    cancel_term->point = cancel_saved.point;
+    cancel_term->fillbox = cancel_saved.fillbox;
+    cancel_term->filled_polygon = cancel_saved.filled_polygon;
+    cancel_term = NULL;
+}
+
+/* Cancellation point outside the terminal: command start, function
+ * sampling and data reading. Also follows a 'set terminal' run by the
+ * command, so the terminal that draws the plot is the one hooked. */
+static void
+check_cancel_outside_plot(void)
+{
+    if (!cancel_armed) {
+        return;
+    }
+
+    if (term != cancel_term) {
+        cancel_unhook_term();
+        cancel_hook_term();
+    }
+
+    if (cancel_due()) {
+        cancel_unwind(0);
+    }
+}
+
+/* Function sampling in plot2d.c and plot3d.c, which build.sh compiles
+ * with evaluate_at() renamed to this */
+void
+gp_sampled_evaluate_at(struct at_type *at_ptr, struct value *val_ptr)
+{
+    check_cancel_outside_plot();
+    evaluate_at(at_ptr, val_ptr);
+}
+
+/* Data reading: build.sh compiles datafile.c with its df_readline()
+ * renamed, so every caller reaches it through this one */
+int gp_unchecked_df_readline(double v[], int max);
+
+int
+df_readline(double v[], int max)
+{
+    check_cancel_outside_plot();
+    return gp_unchecked_df_readline(v, max);
+}
+
+/* Start a cancellable command on the current terminal
+ * timeout_ms = 0 means no deadline. Requests made before this point belong
+ * to no command and are dropped. */
+static void
+cancel_arm(unsigned int timeout_ms)
+{
+    cancel_unwound = 0;
+    cancel_polls = 0;
+    cancel_deadline = timeout_ms ? monotonic_ms() + timeout_ms : 0;
+
+    /* Small enough for any sig_atomic_t; never 0 */
+    cancel_last_generation = cancel_last_generation % 127 + 1;
+    cancel_requested = 0;
+    cancel_generation = cancel_last_generation;
+
+    cancel_hook_term();
+    cancel_armed = 1;
+}
+
+/* End a cancellable command
+ * Returns GNUPLOT_CANCELLED if it was cancelled, otherwise result */
+static int
+cancel_disarm(int result)
+{
+    cancel_armed = 0;
+    cancel_deadline = 0;
+    cancel_unhook_term();
+
+    /* The request belonged to this command, whether or not it got to a
+     * cancellation point; later ones name no command */
+    cancel_generation = 0;
+    cancel_requested = 0;
+
+    /* What lib_inter() does when no command is running */
+    if (cancel_interrupted) {
+        cancel_interrupted = 0;
+        term_reset();
+    }
+
+    return cancel_unwound ? GNUPLOT_CANCELLED : result;
+}
+
 /* Initialize gnuplot library */
 int gnuplot_init(void)
 {
@@ -147,9 +716,17 @@ int gnuplot_init(void)
     /* user-defined variables start immediately after NaN */
     udv_user_head = &(udv_NaN->next_udv);
 
+    /* Index the globals before any script can open a 'local' scope */
+    udv_index_sync();
+
     /* Initialize memory structures */
     init_memory_lib();
 
+#ifndef _WIN32
+    /* Dataset caches of crashed processes */
+    dataset_remove_stale();
+#endif
+
     /* Setup error handling */
     if (!SETJMP(lib_command_line_env, 1)) {
         interrupt_setup();
@@ -186,6 +763,12 @@ int gnuplot_init(void)
         /* Execute reset to set default state */
         reset_command();
 
+        /* Snapshots keep only the settings that differ from these */
+        state_lines_free(&state_defaults);
+        if (state_capture_settings(&state_defaults) != 0) {
+            memset(&state_defaults, 0, sizeof(state_defaults));
+        }
+
         lib_initialized = 1;
         return 0;
     } else {
@@ -195,8 +778,9 @@ int gnuplot_init(void)
     }
 }
 
-/* Execute a gnuplot command */
-int gnuplot_cmd(const char *command)
+/* Execute a command, optionally with a deadline (timeout_ms = 0: none) */
+static int
+run_command(const char *command, unsigned int timeout_ms)
 {
     if (!lib_initialized) {
         return -1; /* Not initialized */
@@ -206,6 +790,12 @@ int gnuplot_cmd(const char *command)
         return -1; /* Invalid command */
     }
 
+    /* Reject calls from inside a running command (e.g. a command sink);
+     * they would overwrite the outer command's jump buffer */
+    if (lib_busy) {
+        return -1;
+    }
+
     /* Check if this is a plot/splot/replot command */
     /* Hook terminal to auto-save bitmap before it gets freed */
     const char *cmd_trimmed = command;
@@ -215,18 +805,62 @@ int gnuplot_cmd(const char *command)
         strncmp(cmd_trimmed, "splot ", 6) == 0 ||
         strncmp(cmd_trimmed, "replot", 6) == 0) {
         hook_terminal_text();
+
+        /* Plotting leaves the saved configuration alone unless it assigns
+         * (iteration variables, inline 'a=...' or 'sample [t=...]') */
+        if (strchr(cmd_trimmed, '=') || strchr(cmd_trimmed, ';')) {
+            state_generation++;
+        }
+    } else {
+        state_generation++;
     }
 
     /* Use gnuplot's built-in command execution */
+    lib_busy = 1;
+    mem_vars_stale = 1;
+    cancel_arm(timeout_ms);
     if (!SETJMP(lib_command_line_env, 1)) {
+        check_cancel_outside_plot();
         do_string(command);
-        return 0;
+        mem_check_variables();
+        lib_busy = 0;
+        mem_after_command();
+        return cancel_disarm(0);
     } else {
         /* Error occurred during command execution */
         /* Make sure to unhook if error happened */
+        lib_busy = 0;
         unhook_terminal_text();
-        return -1;
+        mem_after_command();
+        return cancel_disarm(-1);
+    }
+}
+
+/* Execute a gnuplot command */
+int gnuplot_cmd(const char *command)
+{
+    return run_command(command, 0);
+}
+
+/* Execute a command with a deadline */
+int gnuplot_cmd_with_deadline(const char *command, unsigned int timeout_ms)
+{
+    /* A zero budget is spent before the command starts; run_command()
+     * would take 0 to mean no deadline */
+    if (timeout_ms == 0) {
+        if (!lib_initialized || command == NULL || *command == '\0' || lib_busy) {
+            return -1;
+        }
+        return GNUPLOT_CANCELLED;
     }
+    return run_command(command, timeout_ms);
+}
+
+/* Cancel the running command */
+void gnuplot_cancel(void)
+{
+    /* 0 between commands, which matches no command */
+    cancel_requested = cancel_generation;
 }
 
 /* Execute multiple commands */
@@ -273,292 +907,3485 @@ int gnuplot_cmd_multi(const char *commands)
     return result;
 }
 
-/* Reset gnuplot to initial state */
-void gnuplot_reset(void)
+/* Open an in-memory buffer as a read-only stream */
+static FILE *
+open_memory_stream(const char *buf, size_t len)
 {
-    if (!lib_initialized) {
-        return;
+#ifdef _WIN32
+    /* No fmemopen() on Windows - go through an anonymous temporary file */
+    FILE *fp = tmpfile();
+    if (!fp) {
+        return NULL;
     }
-
-    gnuplot_cmd("reset");
+    if (fwrite(buf, 1, len, fp) != len) {
+        fclose(fp);
+        return NULL;
+    }
+    rewind(fp);
+    return fp;
+#else
+    return fmemopen((void *)buf, len, "r");
+#endif
 }
 
-/* Cleanup and close gnuplot */
-void gnuplot_close(void)
+/* Open a write stream that collects its output in memory
+ * The contents are returned by close_capture_stream() */
+static FILE *
+open_capture_stream(char **buf, size_t *len)
 {
-    if (!lib_initialized) {
-        return;
-    }
-
-    term_reset();
-    lib_initialized = 0;
+    *buf = NULL;
+    *len = 0;
+#ifdef _WIN32
+    /* No open_memstream() on Windows - collect in a temporary file */
+    return tmpfile();
+#else
+    return open_memstream(buf, len);
+#endif
 }
 
-/* Get gnuplot version */
-const char* gnuplot_get_version(void)
+/* Close a capture stream and return its NUL-terminated contents
+ * Returns 0 on success; the caller frees *buf */
+static int
+close_capture_stream(FILE *fp, char **buf, size_t *len)
 {
-    extern const char gnuplot_version[];
-    extern const char gnuplot_patchlevel[];
-    static char version_str[256];
-    snprintf(version_str, sizeof(version_str), "%s patchlevel %s",
-             gnuplot_version, gnuplot_patchlevel);
-    return version_str;
-}
+#ifdef _WIN32
+    long size;
 
-/* Check if initialized */
-int gnuplot_is_initialized(void)
-{
-    return lib_initialized;
+    fflush(fp);
+    size = ftell(fp);
+    if (size < 0) {
+        fclose(fp);
+        return -1;
+    }
+    *buf = (char *)malloc(size + 1);
+    if (!*buf) {
+        fclose(fp);
+        return -1;
+    }
+    rewind(fp);
+    *len = fread(*buf, 1, size, fp);
+    (*buf)[*len] = '\0';
+    fclose(fp);
+    return 0;
+#else
+    /* fclose() finalizes the buffer and length */
+    if (fclose(fp) != 0) {
+        free(*buf);
+        *buf = NULL;
+        return -1;
+    }
+    return 0;
+#endif
 }
 
-/* Set datablock content directly */
-int gnuplot_set_datablock(const char *name, const char *data)
+/* Execute a script held in memory */
+int gnuplot_run_script(const char *script, size_t len)
 {
-    struct udvt_entry *datablock;
-    char *datablock_name;
+    FILE *fp;
 
     if (!lib_initialized) {
-        return -1; /* Not initialized */
+        return -1;
     }
 
-    if (name == NULL || data == NULL) {
-        return -1; /* Invalid parameters */
+    if (script == NULL || len == 0 || lib_busy) {
+        return -1;
     }
 
-    /* Ensure name starts with $ */
-    if (name[0] == '$') {
-        datablock_name = gp_strdup(name);
-    } else {
-        /* Add $ prefix */
-        datablock_name = (char *)gp_alloc(strlen(name) + 2, "datablock name");
-        datablock_name[0] = '$';
-        strcpy(datablock_name + 1, name);
+    fp = open_memory_stream(script, len);
+    if (!fp) {
+        return -1;
     }
 
-    /* Create or get the datablock variable */
-    datablock = add_udv_by_name(datablock_name);
+    state_generation++;
 
-    /* Initialize as empty datablock if not already one */
-    if (datablock->udv_value.type != DATABLOCK) {
-        free_value(&datablock->udv_value);
-        datablock->udv_value.type = DATABLOCK;
-        datablock->udv_value.v.data_array = NULL;
-    }
+    /* A script may contain several plots - keep the bitmap hook in place
+     * for all of them instead of sniffing each line for plot commands */
+    hook_terminal_text();
+    term_hook_persistent = 1;
 
-    /* Clear existing data if any */
-    if (datablock->udv_value.v.data_array) {
-        gpfree_datablock(&datablock->udv_value);
-        datablock->udv_value.type = DATABLOCK;
-        datablock->udv_value.v.data_array = NULL;
+    lib_busy = 1;
+    mem_vars_stale = 1;
+    cancel_arm(0);
+    if (!SETJMP(lib_command_line_env, 1)) {
+        check_cancel_outside_plot();
+        /* load_file() closes the stream when it reaches the end and frees
+         * the name. A leading '<' would make lf_pop() pclose() the stream
+         * in builds with PIPES, so use a plain name like load_command does */
+        load_file(fp, gp_strdup("memory script"), 1);
+        mem_check_variables();
+        lib_busy = 0;
+        term_hook_persistent = 0;
+        unhook_terminal_text();
+        mem_after_command();
+        return cancel_disarm(0);
+    } else {
+        /* Pop the load_file() context, closing the stream */
+        load_file_error();
+        lib_busy = 0;
+        term_hook_persistent = 0;
+        unhook_terminal_text();
+        mem_after_command();
+        return cancel_disarm(-1);
     }
-
-    /* Add the data using gnuplot's append_multiline function
-     * This handles newlines and creates the data_array properly */
-    append_multiline_to_datablock(&datablock->udv_value, gp_strdup(data));
-
-    free(datablock_name);
-    return 0;
 }
 
-/* Initialize memory (simplified version of init_memory from plot.c) */
-static void init_memory_lib(void)
+/* Variables a snapshot covers: the ones save_variables() writes */
+static int
+state_user_variable(const struct udvt_entry *udv)
 {
-    extend_input_line();
-    extend_token_table();
-    replot_line = gp_strdup("");
+    const char *name = udv->udv_name;
+
+    if (udv == first_udv) {
+        return 0;  /* pi */
+    }
+    if (udv->udv_value.type == ARRAY) {
+        return strncmp(name, "ARGV", 4) != 0;
+    }
+    return strncmp(name, "GPVAL_", 6) && strncmp(name, "GPFUN_", 6) &&
+           strncmp(name, "MOUSE_", 6) && name[0] != '$' &&
+           (strncmp(name, "ARG", 3) || strlen(name) != 4) &&
+           strcmp(name, "NaN");
 }
 
-/* Include bitmap functions */
-#include "bitmap.h"
+/* Free the datablock copies of a snapshot */
+static void
+state_free_datablocks(state_datablock_t *block)
+{
+    while (block) {
+        state_datablock_t *next = block->next;
+        char **line;
 
-/* Global buffer for saved bitmap data */
-static unsigned char *saved_rgb_data = NULL;
-static unsigned int saved_width = 0;
-static unsigned int saved_height = 0;
+        for (line = block->lines; line && *line; line++) {
+            free(*line);
+        }
+        free(block->lines);
+        free(block->name);
+        free(block);
+        block = next;
+    }
+}
 
-/* Save bitmap RGB data - must be called while bitmap still exists */
-void* gnuplot_save_bitmap_data(void)
+/* Copy a NULL-terminated datablock line array */
+static char **
+state_copy_lines(char **lines)
 {
-    /* Verify we're using PBM terminal */
-    if (!term || !term->name || strcmp(term->name, "pbm") != 0) {
-        return NULL;  /* Not PBM terminal */
-    }
+    char **copy;
+    size_t n = 0, i;
 
-    /* Check if bitmap exists (PBM terminal) */
-    if (!b_p || !(*b_p) || b_xsize == 0 || b_ysize == 0) {
-        return NULL;
+    while (lines && lines[n]) {
+        n++;
     }
-
-    /* Check if color mode (need 4 planes for RGB) */
-    if (b_planes < 4) {
-        return NULL;
+    copy = (char **)gp_alloc((n + 1) * sizeof(char *), "snapshot datablock");
+    for (i = 0; i < n; i++) {
+        copy[i] = gp_strdup(lines[i]);
     }
+    copy[n] = NULL;
+    return copy;
+}
 
-    unsigned int width = b_ysize;   /* Reversed due to raster mode */
-    unsigned int height = b_xsize;
+static int
+state_line_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-    /* Calculate buffer size */
-    size_t rgb_size = width * height * 3;
+/* Split a script into lines, in place; text is owned by lines afterwards
+ * Returns 0 on success */
+static int
+state_lines_split(char *text, state_lines_t *lines)
+{
+    size_t n = 0, i = 0;
+    char *p;
 
-    /* Free previous saved data if any */
-    if (saved_rgb_data) {
-        free(saved_rgb_data);
+    memset(lines, 0, sizeof(*lines));
+    for (p = text; *p; p++) {
+        n += (*p == '\n');
     }
-
-    /* Allocate new buffer (with space for width/height header) */
-    saved_rgb_data = (unsigned char *)malloc(sizeof(unsigned int) * 2 + rgb_size);
-    if (!saved_rgb_data) {
-        return NULL;
+    lines->line = (char **)malloc((n + 1) * 2 * sizeof(char *));
+    if (!lines->line) {
+        free(text);
+        return -1;
     }
+    lines->sorted = lines->line + n + 1;
+    lines->text = text;
 
-    /* Store width and height at start of buffer */
-    ((unsigned int*)saved_rgb_data)[0] = width;
-    ((unsigned int*)saved_rgb_data)[1] = height;
-
-    /* Extract RGB data - same logic as PBM_colortext() */
-    unsigned char *rgb_ptr = saved_rgb_data + sizeof(unsigned int) * 2;
+    p = text;
+    while (*p) {
+        char *start = p;
+        char *eol;
 
-    for (int x = height - 1; x >= 0; x--) {
-        int row = (width / 8) - 1;
-        for (int j = row; j >= 0; j--) {
-            int mask = 0x80;
-            int plane1 = (*((*b_p)[j] + x));
-            int plane2 = (*((*b_p)[j + b_psize] + x));
-            int plane3 = (*((*b_p)[j + b_psize + b_psize] + x));
-            int plane4 = (*((*b_p)[j + b_psize + b_psize + b_psize] + x));
+        /* Find the end of the line, following continuations */
+        for (eol = p; *eol && !(*eol == '\n' && (eol == p || eol[-1] != '\\')); eol++)
+            ;
+        p = *eol ? eol + 1 : eol;
+        *eol = '\0';
 
-            for (int i = 0; i < 8; i++) {
-                int red = (plane3 & mask) ? 1 : 3;
-                int green = (plane2 & mask) ? 1 : 3;
-                int blue = (plane1 & mask) ? 1 : 3;
-                if (plane4 & mask) {
-                    red--;
-                    green--;
-                    blue--;
-                }
-                /* Scale to 0-255 range (85 = 255/3) */
-                *rgb_ptr++ = (unsigned char)(red * 85);
-                *rgb_ptr++ = (unsigned char)(green * 85);
-                *rgb_ptr++ = (unsigned char)(blue * 85);
-                mask >>= 1;
-            }
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        if (*start && *start != '#') {
+            lines->line[i++] = start;
         }
     }
+    lines->count = i;
+    memcpy(lines->sorted, lines->line, i * sizeof(char *));
+    qsort(lines->sorted, i, sizeof(char *), state_line_compare);
+    return 0;
+}
 
-    saved_width = width;
-    saved_height = height;
-
-    return saved_rgb_data;
+static void
+state_lines_free(state_lines_t *lines)
+{
+    free(lines->text);
+    free(lines->line);
+    memset(lines, 0, sizeof(*lines));
 }
 
-/* Get the saved PBM bitmap data (already saved by terminal) */
-void* gnuplot_get_saved_pbm_rgb_data(void)
+static int
+state_lines_has(const state_lines_t *lines, const char *line)
 {
-    return saved_rgb_data;
+    return lines->count &&
+           bsearch(&line, lines->sorted, lines->count, sizeof(char *),
+                   state_line_compare) != NULL;
 }
 
-/* Free saved PBM bitmap data */
-void gnuplot_free_saved_pbm_bitmap(void)
+/* Is every line of a also a line of b? */
+static int
+state_lines_subset(const state_lines_t *a, const state_lines_t *b)
 {
-    if (saved_rgb_data) {
-        free(saved_rgb_data);
-        saved_rgb_data = NULL;
-        saved_width = 0;
-        saved_height = 0;
+    size_t i;
+
+    for (i = 0; i < a->count; i++) {
+        if (!state_lines_has(b, a->line[i])) {
+            return 0;
+        }
     }
+    return 1;
 }
 
-/* luacmd terminal command capture implementation */
-static luacmd_command_t *command_buffer = NULL;
-static int command_count = 0;
-static int command_capacity = 0;
-static int plot_width = 800;
-static int plot_height = 600;
-
-void luacmd_begin_plot(int width, int height)
+/* Capture the current settings as written by 'save set' */
+static int
+state_capture_settings(state_lines_t *lines)
 {
-    plot_width = width;
-    plot_height = height;
-    luacmd_clear_commands();
+    char *text;
+    size_t len;
+    FILE *fp = open_capture_stream(&text, &len);
+
+    if (!fp) {
+        return -1;
+    }
+    save_set(fp);
+    if (close_capture_stream(fp, &text, &len) != 0) {
+        return -1;
+    }
+    return state_lines_split(text, lines);
 }
 
-void luacmd_end_plot(void)
+/* Capture the current settings that differ from the defaults */
+static int
+state_capture_changes(state_lines_t *changes)
 {
-    /* Plot is complete, commands are ready to be retrieved */
+    state_lines_t all;
+    size_t i, bytes = 1;
+    char *p;
+
+    if (state_capture_settings(&all) != 0) {
+        return -1;
+    }
+    for (i = 0; i < all.count; i++) {
+        if (!state_lines_has(&state_defaults, all.line[i])) {
+            bytes += strlen(all.line[i]) + 1;
+        }
+    }
+
+    /* Copy the changed lines, newline-separated, and split the copy */
+    p = (char *)malloc(bytes);
+    if (!p) {
+        state_lines_free(&all);
+        return -1;
+    }
+    bytes = 0;
+    for (i = 0; i < all.count; i++) {
+        if (!state_lines_has(&state_defaults, all.line[i])) {
+            size_t len = strlen(all.line[i]);
+
+            memcpy(p + bytes, all.line[i], len);
+            p[bytes + len] = '\n';
+            bytes += len + 1;
+        }
+    }
+    p[bytes] = '\0';
+    state_lines_free(&all);
+    return state_lines_split(p, changes);
 }
 
-void luacmd_clear_commands(void)
+/* Run the lines that are not in skip (may be NULL) as one script */
+static int
+state_run_lines(const state_lines_t *lines, const state_lines_t *skip)
 {
-    /* Free all text strings */
-    for (int i = 0; i < command_count; i++) {
-        if (command_buffer[i].text) {
-            free(command_buffer[i].text);
+    size_t i, len = 0;
+    char *script;
+    int result = 0;
+
+    for (i = 0; i < lines->count; i++) {
+        if (!skip || !state_lines_has(skip, lines->line[i])) {
+            len += strlen(lines->line[i]) + 1;
         }
     }
+    if (len == 0) {
+        return 0;
+    }
 
-    /* Reset count but keep buffer allocated */
-    command_count = 0;
+    script = (char *)malloc(len + 1);
+    if (!script) {
+        return -1;
+    }
+    len = 0;
+    for (i = 0; i < lines->count; i++) {
+        if (!skip || !state_lines_has(skip, lines->line[i])) {
+            size_t n = strlen(lines->line[i]);
+
+            memcpy(script + len, lines->line[i], n);
+            script[len + n] = '\n';
+            len += n + 1;
+        }
+    }
+    script[len] = '\0';
+    result = gnuplot_run_script(script, len);
+    free(script);
+    return result;
 }
 
-void luacmd_add_command(int type, int x1, int y1, int x2, int y2,
-                      const char *text, unsigned int color, double value)
+/* Bring the settings to those of a snapshot
+ * When every setting that differs from the defaults now is also in the
+ * snapshot, only the snapshot's other settings are run. Otherwise 'reset'
+ * comes first; should some changed setting survive it (e.g. a path),
+ * every default is set again before the snapshot's settings. */
+static int
+state_restore_settings(const state_lines_t *target)
 {
-    /* Grow buffer if needed */
-    if (command_count >= command_capacity) {
-        command_capacity = (command_capacity == 0) ? 1024 : command_capacity * 2;
-        command_buffer = (luacmd_command_t *)realloc(command_buffer,
-                                                     command_capacity * sizeof(luacmd_command_t));
-        if (!command_buffer) {
-            command_count = 0;
-            command_capacity = 0;
-            return;
+    state_lines_t now;
+    int result;
+
+    if (state_capture_changes(&now) != 0) {
+        return -1;
+    }
+    if (!state_lines_subset(&now, target)) {
+        state_lines_free(&now);
+        if (gnuplot_cmd("reset") != 0 || state_capture_changes(&now) != 0) {
+            return -1;
+        }
+        if (!state_lines_subset(&now, target)) {
+            state_lines_free(&now);
+            if (state_run_lines(&state_defaults, NULL) != 0) {
+                return -1;
+            }
         }
     }
 
-    /* Add command */
-    luacmd_command_t *cmd = &command_buffer[command_count++];
-    cmd->type = type;
-    cmd->x1 = x1;
-    cmd->y1 = y1;
-    cmd->x2 = x2;
-    cmd->y2 = y2;
-    cmd->text = text ? strdup(text) : NULL;
-    cmd->color = color;
-    cmd->value = value;
+    result = state_run_lines(target, &now);
+    state_lines_free(&now);
+    return result;
 }
 
-luacmd_command_t* luacmd_get_commands(int *count, int *width, int *height)
+/* Snapshot the current configuration */
+gnuplot_state_t* gnuplot_state_save(void)
 {
-    *count = command_count;
-    *width = plot_width;
-    *height = plot_height;
+    gnuplot_state_t *state;
+    state_datablock_t **tail;
+    struct udvt_entry *udv;
+    FILE *fp;
 
-    /* Return copy of commands */
-    if (command_count == 0) {
+    if (!lib_initialized || lib_busy) {
         return NULL;
     }
 
-    luacmd_command_t *copy = (luacmd_command_t *)malloc(command_count * sizeof(luacmd_command_t));
-    if (!copy) {
+    state = (gnuplot_state_t *)malloc(sizeof(gnuplot_state_t));
+    if (!state) {
         return NULL;
     }
+    memset(state, 0, sizeof(*state));
 
-    for (int i = 0; i < command_count; i++) {
-        copy[i] = command_buffer[i];
-        /* Duplicate text strings */
-        copy[i].text = command_buffer[i].text ? strdup(command_buffer[i].text) : NULL;
+    if (state_capture_changes(&state->settings) != 0) {
+        free(state);
+        return NULL;
     }
 
-    return copy;
+    fp = open_capture_stream(&state->script, &state->len);
+    if (!fp) {
+        state_lines_free(&state->settings);
+        free(state);
+        return NULL;
+    }
+    save_functions(fp);
+    save_variables(fp);
+    if (close_capture_stream(fp, &state->script, &state->len) != 0) {
+        state_lines_free(&state->settings);
+        free(state);
+        return NULL;
+    }
+
+    /* save.c writes the terminal only as a comment; restore switches to it
+     * separately, and only when it is not already active */
+    if (term) {
+        state->term_name = gp_strdup(term->name);
+        state->term_options = gp_strdup(term_options);
+    }
+
+    /* save_variables() skips datablocks; copy their lines directly rather
+     * than writing them out as heredocs to be parsed again */
+    tail = &state->datablocks;
+    for (udv = first_udv; udv; udv = udv->next_udv) {
+        if (udv->udv_value.type == DATABLOCK) {
+            state_datablock_t *block = (state_datablock_t *)gp_alloc(sizeof(*block),
+                                                                   "snapshot datablock");
+            block->name = gp_strdup(udv->udv_name);
+            block->lines = state_copy_lines(udv->udv_value.v.data_array);
+            block->next = NULL;
+            *tail = block;
+            tail = &block->next;
+        }
+    }
+
+    /* The snapshot describes the configuration in effect right now */
+    active_state = state;
+    active_generation = state_generation;
+
+    return state;
 }
 
-void luacmd_free_commands(luacmd_command_t *commands)
+/* Undefine user variables and datablocks; 'reset' leaves them alone */
+static void
+state_clear_variables(void)
 {
-    if (!commands) {
-        return;
+    struct udvt_entry *udv;
+
+    for (udv = first_udv; udv; udv = udv->next_udv) {
+        struct value *v = &udv->udv_value;
+
+        if (v->type == DATABLOCK) {
+            gpfree_datablock(v);
+            v->type = NOTDEFINED;
+        } else if (v->type != NOTDEFINED && state_user_variable(udv)) {
+            free_value(v);
+            v->type = NOTDEFINED;
+        }
     }
+}
 
-    /* Note: We don't know the count here, but in practice this function
-     * won't be used - Lua will manage the memory */
-    free(commands);
+/* Restore a configuration snapshot */
+int gnuplot_state_restore(gnuplot_state_t *state)
+{
+    state_datablock_t *block;
+
+    if (!lib_initialized || state == NULL) {
+        return -1;
+    }
+
+    /* Nothing has changed since this snapshot was last in effect */
+    if (state == active_state && state_generation == active_generation) {
+        return 0;
+    }
+
+    if (lib_busy) {
+        return -1;
+    }
+
+    active_state = NULL;
+
+    /* Re-initializing the terminal is the most expensive part of a switch
+     * between widgets, which normally share one terminal */
+    if (state->term_name &&
+        (!term || strcmp(term->name, state->term_name) != 0 ||
+         strcmp(term_options, state->term_options) != 0)) {
+        char *set_term = (char *)gp_alloc(strlen(state->term_name) +
+                                          strlen(state->term_options) + 16,
+                                          "set terminal");
+        int result;
+
+        sprintf(set_term, "set terminal %s %s", state->term_name, state->term_options);
+        result = gnuplot_cmd(set_term);
+        free(set_term);
+        if (result != 0) {
+            return -1;
+        }
+    }
+
+    if (state_restore_settings(&state->settings) != 0) {
+        return -1;
+    }
+
+    state_clear_variables();
+    if (state->len > 0 && gnuplot_run_script(state->script, state->len) != 0) {
+        return -1;
+    }
+
+    for (block = state->datablocks; block; block = block->next) {
+        struct udvt_entry *udv = udv_add(block->name);
+
+        if (udv->udv_value.type == DATABLOCK) {
+            gpfree_datablock(&udv->udv_value);
+        } else {
+            free_value(&udv->udv_value);
+        }
+        udv->udv_value.type = DATABLOCK;
+        udv->udv_value.v.data_array = state_copy_lines(block->lines);
+    }
+    mem_vars_stale = 1;
+
+    active_state = state;
+    active_generation = state_generation;
+    return 0;
+}
+
+/* Free a configuration snapshot */
+void gnuplot_state_free(gnuplot_state_t *state)
+{
+    if (!state) {
+        return;
+    }
+
+    if (state == active_state) {
+        active_state = NULL;
+    }
+
+    state_free_datablocks(state->datablocks);
+    state_lines_free(&state->settings);
+    free(state->term_name);
+    free(state->term_options);
+    free(state->script);
+    free(state);
+}
+
+/* Reset gnuplot to initial state */
+void gnuplot_reset(void)
+{
+    if (!lib_initialized) {
+        return;
+    }
+
+    gnuplot_cmd("reset");
+}
+
+/* Cleanup and close gnuplot */
+void gnuplot_close(void)
+{
+    /* Not from inside a running command, e.g. a strip sink */
+    if (!lib_initialized || lib_busy) {
+        return;
+    }
+
+    term_reset();
+    gnuplot_dataset_free(NULL);
+    state_lines_free(&state_defaults);
+    lib_initialized = 0;
+}
+
+/* Get gnuplot version */
+const char* gnuplot_get_version(void)
+{
+    extern const char gnuplot_version[];
+    extern const char gnuplot_patchlevel[];
+    static char version_str[256];
+    snprintf(version_str, sizeof(version_str), "%s patchlevel %s",
+             gnuplot_version, gnuplot_patchlevel);
+    return version_str;
+}
+
+/* Check if initialized */
+int gnuplot_is_initialized(void)
+{
+    return lib_initialized;
+}
+
+/* Datablock variable name for name, with the '$' prefix added if missing */
+static char *
+datablock_key(const char *name)
+{
+    char *key;
+
+    if (name[0] == '$') {
+        return gp_strdup(name);
+    }
+    key = (char *)gp_alloc(strlen(name) + 2, "datablock name");
+    key[0] = '$';
+    strcpy(key + 1, name);
+    return key;
+}
+
+/* Replace datablock key with lines (a NULL-terminated array of allocated
+ * lines, as gnuplot keeps them) holding bytes as datablock_bytes() counts.
+ * Takes ownership of key and lines, freeing them on failure.
+ * Returns 0 on success, -1 if the datablock limit would be exceeded */
+static int
+datablock_store(char *key, char **lines, size_t bytes)
+{
+    struct udvt_entry *datablock;
+    size_t old_bytes = 0;
+
+    /* A limit needs a current total: rescan if a command changed
+     * variables since the last scan, then follow our own changes */
+    if (mem_vars_stale && mem_usage[GNUPLOT_MEM_DATABLOCK].limit) {
+        mem_scan_variables();
+    }
+    if (!mem_vars_stale && (datablock = udv_find(key)) != NULL) {
+        old_bytes = datablock_bytes(&datablock->udv_value);
+    }
+
+    /* Enforce the datablock limit, counting the block being replaced out */
+    if (mem_usage[GNUPLOT_MEM_DATABLOCK].limit &&
+        mem_usage[GNUPLOT_MEM_DATABLOCK].current - old_bytes + bytes
+        > mem_usage[GNUPLOT_MEM_DATABLOCK].limit) {
+        struct value rejected;
+
+        rejected.type = DATABLOCK;
+        rejected.v.data_array = lines;
+        gpfree_datablock(&rejected);
+        free(key);
+        return -1;
+    }
+
+    state_generation++;
+
+    /* Create or get the datablock variable */
+    datablock = udv_add(key);
+
+    if (datablock->udv_value.type == DATABLOCK) {
+        gpfree_datablock(&datablock->udv_value);
+    } else {
+        if (!mem_vars_stale) {
+            mem_note(GNUPLOT_MEM_UDV, mem_usage[GNUPLOT_MEM_UDV].current
+                                      - udv_value_bytes(&datablock->udv_value));
+        }
+        free_value(&datablock->udv_value);
+    }
+    datablock->udv_value.type = DATABLOCK;
+    datablock->udv_value.v.data_array = lines;
+
+    if (!mem_vars_stale) {
+        mem_note(GNUPLOT_MEM_DATABLOCK,
+                 mem_usage[GNUPLOT_MEM_DATABLOCK].current - old_bytes + bytes);
+    }
+
+    free(key);
+    return 0;
+}
+
+/* Set datablock content directly */
+int gnuplot_set_datablock(const char *name, const char *data)
+{
+    struct value block;
+
+    if (!lib_initialized || lib_busy) {
+        return -1; /* Not initialized, or a command is running */
+    }
+
+    if (name == NULL || data == NULL) {
+        return -1; /* Invalid parameters */
+    }
+
+    /* Split the text into lines with gnuplot's append_multiline function */
+    block.type = DATABLOCK;
+    block.v.data_array = NULL;
+    append_multiline_to_datablock(&block, gp_strdup(data));
+
+    return datablock_store(datablock_key(name), block.v.data_array,
+                           datablock_bytes(&block));
+}
+
+/* Batch evaluation
+ * An expression is parsed once into an action table and checked for
+ * operations the block interpreter supports. Those tables run over
+ * BATCH_BLOCK samples per step, each step a plain loop over arrays;
+ * anything else runs through gnuplot's evaluate_at() per sample.
+ */
+#define BATCH_BLOCK 256
+#define BATCH_STACK 32
+
+enum {
+    BATCH_PUSH,     /* Constant */
+    BATCH_VAR,      /* The sampled variable */
+    BATCH_NEG,
+    BATCH_ADD,
+    BATCH_SUB,
+    BATCH_MUL,
+    BATCH_DIV,
+    BATCH_POW,
+    BATCH_FUNC
+};
+
+typedef struct {
+    int op;
+    double constant;            /* BATCH_PUSH */
+    double (*func)(double);     /* BATCH_FUNC */
+} batch_step_t;
+
+/* Builtins with a real-valued libm equivalent */
+static const struct {
+    const char *name;
+    double (*func)(double);
+    int angular;                /* Depends on 'set angles' */
+} batch_functions[] = {
+    {"sin", sin, 1}, {"cos", cos, 1}, {"tan", tan, 1},
+    {"asin", asin, 1}, {"acos", acos, 1}, {"atan", atan, 1},
+    {"sinh", sinh, 0}, {"cosh", cosh, 0}, {"tanh", tanh, 0},
+    {"exp", exp, 0}, {"log", log, 0}, {"log10", log10, 0},
+    {"sqrt", sqrt, 0}, {"abs", fabs, 0},
+    {NULL, NULL, 0}
+};
+
+extern double ang2rad;
+
+/* Function entry that holds the sample for PUSHD1 in the scalar path */
+static struct udft_entry batch_udf;
+
+/* Get a numeric constant; returns 0 for strings, complex values etc. */
+static int
+batch_constant(struct value *v, double *d, int *is_int)
+{
+    if (v->type == INTGR) {
+        *d = (double)v->v.int_val;
+        *is_int = 1;
+        return 1;
+    }
+    if (v->type == CMPLX && v->v.cmplx_val.imag == 0) {
+        *d = v->v.cmplx_val.real;
+        *is_int = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Translate an action table into block steps
+ * Returns the number of steps, or 0 if the table needs the scalar path */
+static int
+batch_compile(struct at_type *at, batch_step_t *steps)
+{
+    /* Integer slots keep gnuplot's integer arithmetic out of the block path:
+     * they only come from constants, and integer-integer operations fall
+     * back (1/2 is 0 in gnuplot) */
+    int is_int[BATCH_STACK];
+    int sp = 0;
+    int i, j;
+
+    for (i = 0; i < at->a_count; i++) {
+        struct at_entry *action = &at->actions[i];
+        batch_step_t *step = &steps[i];
+        int op = action->index;
+
+        step->constant = 0;
+        step->func = NULL;
+
+        if (op == PUSHC || op == PUSH) {
+            struct value *v = (op == PUSHC) ? &action->arg.v_arg
+                                            : &action->arg.udv_arg->udv_value;
+            if (sp >= BATCH_STACK || !batch_constant(v, &step->constant, &is_int[sp])) {
+                return 0;
+            }
+            step->op = BATCH_PUSH;
+            sp++;
+        } else if (op == PUSHD1) {
+            if (sp >= BATCH_STACK) {
+                return 0;
+            }
+            step->op = BATCH_VAR;
+            is_int[sp++] = 0;
+        } else if (op == UMINUS) {
+            if (sp < 1) {
+                return 0;
+            }
+            step->op = BATCH_NEG;
+        } else if (op == PLUS || op == MINUS || op == MULT || op == DIV || op == POWER) {
+            if (sp < 2) {
+                return 0;
+            }
+            /* Both operands integer: leave it to gnuplot */
+            if (is_int[sp - 2] && is_int[sp - 1]) {
+                return 0;
+            }
+            step->op = (op == PLUS) ? BATCH_ADD : (op == MINUS) ? BATCH_SUB :
+                       (op == MULT) ? BATCH_MUL : (op == DIV) ? BATCH_DIV : BATCH_POW;
+            sp--;
+            is_int[sp - 1] = 0;
+        } else if (op >= (int)SF_START) {
+            const char *name = ft[op].f_name;
+
+            if (sp < 1) {
+                return 0;
+            }
+            for (j = 0; batch_functions[j].name; j++) {
+                if (strcmp(name, batch_functions[j].name) == 0) {
+                    break;
+                }
+            }
+            if (!batch_functions[j].name ||
+                (batch_functions[j].angular && ang2rad != 1.0)) {
+                return 0;
+            }
+            /* abs() of an integer stays an integer */
+            if (batch_functions[j].func == fabs && is_int[sp - 1]) {
+                return 0;
+            }
+            step->op = BATCH_FUNC;
+            step->func = batch_functions[j].func;
+            is_int[sp - 1] = 0;
+        } else {
+            return 0;
+        }
+    }
+
+    /* Must leave exactly one real result */
+    if (sp != 1 || is_int[0]) {
+        return 0;
+    }
+    return at->a_count;
+}
+
+/* Run block steps over in[0..n) */
+static void
+batch_run(const batch_step_t *steps, int nsteps, const double *in, double *out, size_t n)
+{
+    /* Per call, so concurrent and nested runs do not share it */
+    double (*stack)[BATCH_BLOCK] =
+        (double (*)[BATCH_BLOCK])gp_alloc(BATCH_STACK * sizeof(*stack), "batch stack");
+    char undef[BATCH_BLOCK];    /* Samples gnuplot would flag undefined */
+    size_t base;
+    int i, k;
+
+    for (base = 0; base < n; base += BATCH_BLOCK) {
+        int m = (n - base < BATCH_BLOCK) ? (int)(n - base) : BATCH_BLOCK;
+        int sp = 0;
+
+        memset(undef, 0, m);
+
+        for (i = 0; i < nsteps; i++) {
+            const batch_step_t *step = &steps[i];
+            double *a = stack[sp - 2 >= 0 ? sp - 2 : 0];
+            double *b = stack[sp - 1 >= 0 ? sp - 1 : 0];
+
+            switch (step->op) {
+            case BATCH_PUSH:
+                for (k = 0; k < m; k++) stack[sp][k] = step->constant;
+                sp++;
+                break;
+            case BATCH_VAR:
+                memcpy(stack[sp], in + base, m * sizeof(double));
+                sp++;
+                break;
+            case BATCH_NEG:
+                for (k = 0; k < m; k++) b[k] = -b[k];
+                break;
+            case BATCH_ADD:
+                for (k = 0; k < m; k++) a[k] += b[k];
+                sp--;
+                break;
+            case BATCH_SUB:
+                for (k = 0; k < m; k++) a[k] -= b[k];
+                sp--;
+                break;
+            case BATCH_MUL:
+                for (k = 0; k < m; k++) a[k] *= b[k];
+                sp--;
+                break;
+            case BATCH_DIV:
+                /* x/0 makes the whole sample undefined in gnuplot, even
+                 * where the rest of the expression would discard it */
+                for (k = 0; k < m; k++) {
+                    if (b[k] != 0) {
+                        a[k] /= b[k];
+                    } else {
+                        a[k] = 0;
+                        undef[k] = 1;
+                    }
+                }
+                sp--;
+                break;
+            case BATCH_POW:
+                /* pow() is NaN for a negative base with a non-integer
+                 * exponent, where gnuplot produces a complex value */
+                for (k = 0; k < m; k++) a[k] = pow(a[k], b[k]);
+                sp--;
+                break;
+            case BATCH_FUNC:
+                for (k = 0; k < m; k++) b[k] = step->func(b[k]);
+                break;
+            }
+        }
+
+        for (k = 0; k < m; k++) {
+            out[base + k] = (!undef[k] && isfinite(stack[0][k])) ? stack[0][k] : NAN;
+        }
+    }
+
+    free(stack);
+}
+
+/* Run an action table through gnuplot's evaluator, one sample at a time */
+static void
+batch_run_scalar(struct at_type *at, const double *in, double *out, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        struct value result;
+
+        (void) Gcomplex(&batch_udf.dummy_values[0], in[i], 0.0);
+        undefined = FALSE;
+        evaluate_at(at, &result);
+
+        if (undefined) {
+            out[i] = NAN;
+        } else if (result.type == INTGR) {
+            out[i] = (double)result.v.int_val;
+        } else if (result.type == CMPLX && fabs(result.v.cmplx_val.imag) <= zero) {
+            out[i] = isfinite(result.v.cmplx_val.real) ? result.v.cmplx_val.real : NAN;
+        } else {
+            out[i] = NAN;
+        }
+        free_value(&result);
+    }
+}
+
+/* Parse expr with var as the dummy variable */
+static struct at_type *
+batch_parse(const char *expr, const char *var)
+{
+    size_t len = strlen(expr);
+    struct at_type *at;
+
+    while (gp_input_line_len <= len) {
+        extend_input_line();
+    }
+    strcpy(gp_input_line, expr);
+
+    /* var is the only dummy variable; other names are user variables */
+    memset(c_dummy_var, 0, sizeof(c_dummy_var));
+    safe_strncpy(c_dummy_var[0], var, MAX_ID_LEN + 1);
+    dummy_func = &batch_udf;
+
+    num_tokens = scanner(&gp_input_line, &gp_input_line_len);
+    c_token = 0;
+    at = perm_at();
+    if (!END_OF_COMMAND) {
+        free_at(at);
+        int_error(c_token, "unexpected text after expression");
+    }
+
+    return at;
+}
+
+/* Evaluate an expression over an array */
+int gnuplot_eval_batch(const char *expr, const char *var,
+                       const double *in, double *out, size_t n)
+{
+    /* Static so they are reliable after the longjmp of an error */
+    static struct at_type *at;
+    static batch_step_t *steps;
+    char saved_dummy[MAX_NUM_VAR][MAX_ID_LEN + 1];
+    struct udft_entry *saved_func;
+    int nsteps;
+
+    if (!lib_initialized) {
+        return -1;
+    }
+
+    if (expr == NULL || (n > 0 && (in == NULL || out == NULL)) || lib_busy) {
+        return -1;
+    }
+
+    at = NULL;
+    steps = NULL;
+    memcpy(saved_dummy, c_dummy_var, sizeof(saved_dummy));
+    saved_func = dummy_func;
+    lib_busy = 1;
+
+    if (!SETJMP(lib_command_line_env, 1)) {
+        at = batch_parse(expr, var ? var : "x");
+        dummy_func = saved_func;
+        memcpy(c_dummy_var, saved_dummy, sizeof(saved_dummy));
+
+        steps = (batch_step_t *)gp_alloc(at->a_count * sizeof(batch_step_t), "batch steps");
+        nsteps = batch_compile(at, steps);
+        if (nsteps > 0) {
+            batch_run(steps, nsteps, in, out, n);
+        } else {
+            batch_run_scalar(at, in, out, n);
+        }
+
+        free(steps);
+        free_at(at);
+        lib_busy = 0;
+        return 0;
+    } else {
+        dummy_func = saved_func;
+        memcpy(c_dummy_var, saved_dummy, sizeof(saved_dummy));
+        free(steps);
+        if (at) {
+            free_at(at);
+        }
+        lib_busy = 0;
+        return -1;
+    }
+}
+
+/* Parallel text ingestion
+ * A dataset is parsed once into a binary cache file of native doubles,
+ * one row-major record per line, which gnuplot's binary reader consumes
+ * without any text conversion. Parsing runs in two parallel passes over
+ * line-aligned chunks: count the data lines of each chunk, then parse each
+ * chunk into its slice of the cache. Datasets are opt-in: plots of a file
+ * name or a datablock still go through gnuplot's own text reader.
+ *
+ * On Linux the cache is unlinked as soon as it is created and reached
+ * through /proc/self/fd while the dataset holds it open, so a crash leaves
+ * nothing behind. Elsewhere cache names carry the process id, and
+ * gnuplot_init() removes caches of processes that no longer run.
+ */
+#define DATASET_MAX_THREADS 64
+
+typedef struct dataset {
+    struct dataset *next;
+    char *name;
+    char *source;               /* File path, NULL for buffers */
+    long long source_size;
+    long long source_mtime_ns;
+    char *cache_path;
+    int cache_fd;               /* Holds an unlinked cache open, -1 = named file */
+    size_t rows;
+    int columns;
+} dataset_t;
+
+static dataset_t *datasets = NULL;
+
+/* One chunk of text and where its rows go */
+typedef struct {
+    const char *begin, *end;
+    size_t rows;                /* Pass 1: data lines in the chunk */
+    double *out;                /* Pass 2: first row of the chunk */
+    int columns;
+} dataset_chunk_t;
+
+/* Exact powers of ten for the fast path */
+static const double dataset_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define DATASET_SEPARATOR(c) ((c) == ',' || (c) == ' ' || (c) == '\t' || (c) == '\r')
+
+/* Is the line [p, eol) data, i.e. not blank and not a comment? */
+static int
+dataset_data_line(const char *p, const char *eol)
+{
+    while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    return p < eol && *p != '#';
+}
+
+/* Parse a number ending at a separator or end of line
+ * Plain decimals whose digits fit in 2^53 with a power of ten up to 1e22
+ * are converted exactly with one multiplication or division; everything
+ * else goes through strtod(). Returns the end of the field. */
+static const char *
+dataset_parse_number(const char *p, const char *eol, double *value, int *ok)
+{
+    const char *start = p;
+    unsigned long long mantissa = 0;
+    int negative = 0, digits = 0, exp10 = 0, any = 0;
+
+    if (p < eol && (*p == '+' || *p == '-')) {
+        negative = (*p == '-');
+        p++;
+    }
+    for (; p < eol && *p >= '0' && *p <= '9'; p++) {
+        any = 1;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) digits++;
+        } else {
+            exp10++;
+        }
+    }
+    if (p < eol && *p == '.') {
+        for (p++; p < eol && *p >= '0' && *p <= '9'; p++) {
+            any = 1;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) digits++;
+                exp10--;
+            }
+        }
+    }
+    if (any && p < eol && (*p == 'e' || *p == 'E')) {
+        int exp_negative = 0, exp_value = 0, exp_digits = 0;
+
+        p++;
+        if (p < eol && (*p == '+' || *p == '-')) {
+            exp_negative = (*p == '-');
+            p++;
+        }
+        for (; p < eol && *p >= '0' && *p <= '9'; p++, exp_digits++) {
+            if (exp_value < 10000) {
+                exp_value = exp_value * 10 + (*p - '0');
+            }
+        }
+        if (!exp_digits) {
+            any = 0;
+        }
+        exp10 += exp_negative ? -exp_value : exp_value;
+    }
+
+    if (any && (p == eol || DATASET_SEPARATOR(*p)) &&
+        mantissa <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+        double d = (double)mantissa;
+        d = (exp10 >= 0) ? d * dataset_pow10[exp10] : d / dataset_pow10[-exp10];
+        *value = negative ? -d : d;
+        *ok = 1;
+        return p;
+    }
+
+    /* Slow path: the whole field through strtod() */
+    {
+        char buf[64];
+        char *endptr;
+        size_t len;
+
+        for (p = start; p < eol && !DATASET_SEPARATOR(*p); p++)
+            ;
+        len = (size_t)(p - start);
+        if (len == 0 || len >= sizeof(buf)) {
+            *value = NAN;
+            *ok = 0;
+            return p;
+        }
+        memcpy(buf, start, len);
+        buf[len] = '\0';
+        *value = strtod(buf, &endptr);
+        *ok = (*endptr == '\0');
+        if (!*ok) {
+            *value = NAN;
+        }
+        return p;
+    }
+}
+
+/* Parse the fields of one line into row[0..columns)
+ * Returns the number of fields that were numbers */
+static int
+dataset_parse_line(const char *p, const char *eol, double *row, int columns, int *fields)
+{
+    int column = 0, numbers = 0;
+
+    while (column < columns || !row) {
+        int ok;
+        double value;
+
+        while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) {
+            p++;
+        }
+        if (p >= eol) {
+            break;
+        }
+
+        if (*p == ',') {
+            /* Empty field */
+            value = NAN;
+            ok = 0;
+        } else {
+            p = dataset_parse_number(p, eol, &value, &ok);
+            while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) {
+                p++;
+            }
+        }
+        if (p < eol && *p == ',') {
+            p++;
+        }
+
+        if (row && column < columns) {
+            row[column] = value;
+        }
+        column++;
+        numbers += ok;
+    }
+
+    if (row) {
+        for (; column < columns; column++) {
+            row[column] = NAN;
+        }
+    }
+    if (fields) {
+        *fields = column;
+    }
+    return numbers;
+}
+
+/* Pass 1: count data lines */
+static void *
+dataset_count_chunk(void *arg)
+{
+    dataset_chunk_t *chunk = (dataset_chunk_t *)arg;
+    const char *p = chunk->begin;
+
+    chunk->rows = 0;
+    while (p < chunk->end) {
+        const char *eol = memchr(p, '\n', chunk->end - p);
+        if (!eol) eol = chunk->end;
+        if (dataset_data_line(p, eol)) {
+            chunk->rows++;
+        }
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+/* Pass 2: parse data lines */
+static void *
+dataset_parse_chunk(void *arg)
+{
+    dataset_chunk_t *chunk = (dataset_chunk_t *)arg;
+    const char *p = chunk->begin;
+    double *row = chunk->out;
+
+    while (p < chunk->end) {
+        const char *eol = memchr(p, '\n', chunk->end - p);
+        if (!eol) eol = chunk->end;
+        if (dataset_data_line(p, eol)) {
+            dataset_parse_line(p, eol, row, chunk->columns, NULL);
+            row += chunk->columns;
+        }
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+/* Run fn over all chunks, one thread each */
+static void
+dataset_run_chunks(void *(*fn)(void *), dataset_chunk_t *chunks, int count)
+{
+#ifdef _WIN32
+    int i;
+    /* No pthreads with the MinGW toolchain used here - run in turn */
+    for (i = 0; i < count; i++) {
+        fn(&chunks[i]);
+    }
+#else
+    pthread_t threads[DATASET_MAX_THREADS];
+    int started[DATASET_MAX_THREADS];
+    int i;
+
+    for (i = 1; i < count; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, fn, &chunks[i]) == 0);
+        if (!started[i]) {
+            fn(&chunks[i]);
+        }
+    }
+    fn(&chunks[0]);
+    for (i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+#endif
+}
+
+static int
+dataset_thread_count(int threads)
+{
+    if (threads <= 0) {
+#if defined(_SC_NPROCESSORS_ONLN)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+        threads = 1;
+#endif
+    }
+    if (threads < 1) threads = 1;
+    if (threads > DATASET_MAX_THREADS) threads = DATASET_MAX_THREADS;
+    return threads;
+}
+
+#ifndef _WIN32
+/* Can caches be unlinked at once and read through /proc/self/fd? */
+static int
+dataset_proc_fd(void)
+{
+#ifdef __linux__
+    return access("/proc/self/fd", X_OK) == 0;
+#else
+    return 0;
+#endif
+}
+
+static const char *
+dataset_tmpdir(void)
+{
+    const char *dir = getenv("TMPDIR");
+
+    return (dir && *dir) ? dir : "/tmp";
+}
+
+/* Remove caches left in the temporary directory by processes that ended
+ * without gnuplot_close(), e.g. after a crash. Only where caches are named
+ * files: with /proc the process ids in other caches' names may belong to
+ * another pid namespace sharing the directory, and their caches are live. */
+static void
+dataset_remove_stale(void)
+{
+    const char *dir = dataset_tmpdir();
+    DIR *d;
+    struct dirent *entry;
+
+    if (dataset_proc_fd()) {
+        return;
+    }
+    d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    while ((entry = readdir(d)) != NULL) {
+        long pid;
+        char *path;
+
+        if (sscanf(entry->d_name, "gnuplot-dataset-%ld-", &pid) != 1 ||
+            pid <= 0 || pid == (long)getpid()) {
+            continue;
+        }
+        /* Still running, or not ours to signal (another user's cache) */
+        if (kill((pid_t)pid, 0) == 0 || errno != ESRCH) {
+            continue;
+        }
+
+        path = (char *)malloc(strlen(dir) + strlen(entry->d_name) + 2);
+        if (!path) {
+            break;
+        }
+        sprintf(path, "%s/%s", dir, entry->d_name);
+        unlink(path);
+        free(path);
+    }
+    closedir(d);
+}
+#endif
+
+/* Create an empty cache file; returns the path plots read it from, or NULL
+ * keep_fd: receives the descriptor keeping an unlinked cache alive, or -1 */
+static char *
+dataset_cache_file(FILE **fp, int *keep_fd)
+{
+#ifdef _WIN32
+    char *path = _tempnam(NULL, "gpds");
+    char *copy;
+
+    *keep_fd = -1;
+    if (!path) {
+        return NULL;
+    }
+    *fp = fopen(path, "w+b");
+    copy = *fp ? gp_strdup(path) : NULL;
+    free(path);
+    return copy;
+#else
+    const char *dir = dataset_tmpdir();
+    char *path;
+    int fd;
+
+    *keep_fd = -1;
+    path = (char *)gp_alloc(strlen(dir) + 64, "dataset cache");
+    sprintf(path, "%s/gnuplot-dataset-%ld-XXXXXX", dir, (long)getpid());
+    fd = mkstemp(path);
+    if (fd < 0) {
+        free(path);
+        return NULL;
+    }
+    *fp = fdopen(fd, "w+b");
+    if (!*fp) {
+        close(fd);
+        unlink(path);
+        free(path);
+        return NULL;
+    }
+
+#ifdef __linux__
+    if (dataset_proc_fd()) {
+        int keep = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+        if (keep >= 0) {
+            unlink(path);
+            sprintf(path, "/proc/self/fd/%d", keep);
+            *keep_fd = keep;
+        }
+    }
+#endif
+    return path;
+#endif
+}
+
+/* Delete a cache created by dataset_cache_file() and free its path */
+static void
+dataset_cache_drop(char *path, int keep_fd)
+{
+#ifndef _WIN32
+    if (keep_fd >= 0) {
+        close(keep_fd);
+        free(path);
+        return;
+    }
+#endif
+    remove(path);
+    free(path);
+}
+
+/* Modification time of a file, to the nanosecond where the platform
+ * records it, so a rewrite within the same second is noticed */
+static long long
+dataset_mtime_ns(const struct stat *st)
+{
+#if defined(_WIN32)
+    return (long long)st->st_mtime * 1000000000LL;
+#elif defined(__APPLE__)
+    return (long long)st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#else
+    return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#endif
+}
+
+/* Parse text into a new cache file
+ * Returns the cache path, or NULL on error; *fd_out as for
+ * dataset_cache_file() */
+static char *
+dataset_parse_text(const char *data, size_t len, int threads,
+                   size_t *rows_out, int *columns_out, int *fd_out)
+{
+    dataset_chunk_t chunks[DATASET_MAX_THREADS];
+    const char *p = data, *end = data + len;
+    int columns = 0, header_checked = 0;
+    int count, i;
+    size_t rows = 0;
+    size_t bytes;
+    double *out;
+    char *path;
+    FILE *fp;
+    int keep_fd;
+
+    /* Skip comments, blank lines and a header; the first data line sets
+     * the number of columns */
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        int fields;
+
+        if (!eol) eol = end;
+        if (dataset_data_line(p, eol)) {
+            int numbers = dataset_parse_line(p, eol, NULL, 0, &fields);
+            if (numbers > 0 || header_checked) {
+                columns = fields;
+                break;
+            }
+            header_checked = 1;
+        }
+        p = (eol < end) ? eol + 1 : end;
+    }
+    if (columns == 0) {
+        return NULL;
+    }
+
+    /* Line-aligned chunks; small inputs are not worth a thread */
+    count = dataset_thread_count(threads);
+    if ((size_t)(end - p) < (size_t)count * 65536) {
+        count = (int)((end - p) / 65536) + 1;
+    }
+    for (i = 0; i < count; i++) {
+        const char *b = (i == 0) ? p : chunks[i - 1].end;
+        const char *e = (i == count - 1) ? end : p + (size_t)(end - p) / count * (i + 1);
+
+        if (e < b) e = b;
+        if (e < end) {
+            const char *nl = memchr(e, '\n', end - e);
+            e = nl ? nl + 1 : end;
+        }
+        chunks[i].begin = b;
+        chunks[i].end = e;
+        chunks[i].columns = columns;
+    }
+
+    dataset_run_chunks(dataset_count_chunk, chunks, count);
+    for (i = 0; i < count; i++) {
+        rows += chunks[i].rows;
+    }
+
+    bytes = rows * columns * sizeof(double);
+    path = dataset_cache_file(&fp, &keep_fd);
+    if (!path) {
+        return NULL;
+    }
+
+#ifdef _WIN32
+    out = (double *)malloc(bytes ? bytes : 1);
+#else
+    /* Parse straight into the mapped cache file */
+    out = MAP_FAILED;
+    if (ftruncate(fileno(fp), (off_t)bytes) == 0 && bytes > 0) {
+        out = (double *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+    }
+    if (out == MAP_FAILED) {
+        out = NULL;
+    }
+#endif
+    if (!out) {
+        fclose(fp);
+        dataset_cache_drop(path, keep_fd);
+        return NULL;
+    }
+
+    for (i = 0, bytes = 0; i < count; i++) {
+        chunks[i].out = out + bytes;
+        bytes += chunks[i].rows * columns;
+    }
+    dataset_run_chunks(dataset_parse_chunk, chunks, count);
+
+#ifdef _WIN32
+    if (fwrite(out, sizeof(double) * columns, rows, fp) != rows) {
+        free(out);
+        fclose(fp);
+        dataset_cache_drop(path, keep_fd);
+        return NULL;
+    }
+    free(out);
+#else
+    munmap(out, rows * columns * sizeof(double));
+#endif
+    fclose(fp);
+
+    *rows_out = rows;
+    *columns_out = columns;
+    *fd_out = keep_fd;
+    return path;
+}
+
+/* Point the string variable name at a dataset's cache */
+static void
+dataset_set_variable(dataset_t *ds)
+{
+    struct udvt_entry *udv = udv_add(ds->name);
+    size_t len = 2 * strlen(ds->cache_path) + 32 + ds->columns * 7;
+    char *spec = (char *)gp_alloc(len, "dataset spec");
+    const char *s;
+    char *p = spec;
+    int i;
+
+    /* A quote in the path (from $TMPDIR) is doubled, as gnuplot reads
+     * single-quoted strings */
+    *p++ = '\'';
+    for (s = ds->cache_path; *s; s++) {
+        if (*s == '\'') {
+            *p++ = '\'';
+        }
+        *p++ = *s;
+    }
+    p += sprintf(p, "' binary format='");
+    for (i = 0; i < ds->columns; i++) {
+        p += sprintf(p, "%%double");
+    }
+    strcpy(p, "'");
+
+    free_value(&udv->udv_value);
+    Gstring(&udv->udv_value, spec);
+    state_generation++;
+    mem_vars_stale = 1;
+}
+
+static dataset_t *
+dataset_find(const char *name)
+{
+    dataset_t *ds;
+
+    for (ds = datasets; ds; ds = ds->next) {
+        if (strcmp(ds->name, name) == 0) {
+            return ds;
+        }
+    }
+    return NULL;
+}
+
+/* Is name usable as a variable in '@name'? */
+static int
+dataset_valid_name(const char *name)
+{
+    const char *p;
+
+    if (!name || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+        return 0;
+    }
+    for (p = name; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '_') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Register a parsed dataset, replacing one of the same name */
+static int
+dataset_store(const char *name, const char *source, long long size, long long mtime_ns,
+              char *cache_path, int cache_fd, size_t rows, int columns,
+              size_t *rows_out, int *columns_out)
+{
+    dataset_t *ds = dataset_find(name);
+
+    if (ds) {
+        dataset_cache_drop(ds->cache_path, ds->cache_fd);
+        free(ds->source);
+    } else {
+        ds = (dataset_t *)gp_alloc(sizeof(dataset_t), "dataset");
+        ds->name = gp_strdup(name);
+        ds->next = datasets;
+        datasets = ds;
+    }
+
+    ds->source = source ? gp_strdup(source) : NULL;
+    ds->source_size = size;
+    ds->source_mtime_ns = mtime_ns;
+    ds->cache_path = cache_path;
+    ds->cache_fd = cache_fd;
+    ds->rows = rows;
+    ds->columns = columns;
+    dataset_set_variable(ds);
+
+    if (rows_out) *rows_out = rows;
+    if (columns_out) *columns_out = columns;
+    return 0;
+}
+
+/* Load a text file into a dataset */
+int gnuplot_dataset_load(const char *name, const char *path, int threads,
+                         size_t *rows, int *columns)
+{
+    struct stat st;
+    dataset_t *ds;
+    const char *data;
+    char *cache_path;
+    int cache_fd;
+    size_t parsed_rows;
+    int parsed_columns;
+
+    if (!lib_initialized || lib_busy || !dataset_valid_name(name) || path == NULL) {
+        return -1;
+    }
+
+    if (stat(path, &st) != 0 || st.st_size == 0) {
+        return -1;
+    }
+
+    /* Same file, unchanged since it was parsed: reuse the cache */
+    ds = dataset_find(name);
+    if (ds && ds->source && strcmp(ds->source, path) == 0 &&
+        ds->source_size == (long long)st.st_size && ds->source_mtime_ns == dataset_mtime_ns(&st)) {
+        FILE *cached = fopen(ds->cache_path, "rb");
+        if (cached) {
+            fclose(cached);
+            dataset_set_variable(ds);
+            if (rows) *rows = ds->rows;
+            if (columns) *columns = ds->columns;
+            return 0;
+        }
+    }
+
+#ifdef _WIN32
+    {
+        FILE *fp = fopen(path, "rb");
+        char *buf;
+
+        if (!fp) {
+            return -1;
+        }
+        buf = (char *)malloc((size_t)st.st_size);
+        if (!buf || fread(buf, 1, (size_t)st.st_size, fp) != (size_t)st.st_size) {
+            free(buf);
+            fclose(fp);
+            return -1;
+        }
+        fclose(fp);
+        data = buf;
+        cache_path = dataset_parse_text(data, (size_t)st.st_size, threads,
+                                        &parsed_rows, &parsed_columns, &cache_fd);
+        free(buf);
+    }
+#else
+    {
+        int fd = open(path, O_RDONLY);
+        void *map;
+
+        if (fd < 0) {
+            return -1;
+        }
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+        data = (const char *)map;
+        cache_path = dataset_parse_text(data, (size_t)st.st_size, threads,
+                                        &parsed_rows, &parsed_columns, &cache_fd);
+        munmap(map, (size_t)st.st_size);
+    }
+#endif
+
+    if (!cache_path) {
+        return -1;
+    }
+
+    return dataset_store(name, path, (long long)st.st_size, dataset_mtime_ns(&st),
+                         cache_path, cache_fd, parsed_rows, parsed_columns, rows, columns);
+}
+
+/* Load text held in memory into a dataset */
+int gnuplot_dataset_load_buffer(const char *name, const char *data, size_t len,
+                                int threads, size_t *rows, int *columns)
+{
+    char *cache_path;
+    int cache_fd;
+    size_t parsed_rows;
+    int parsed_columns;
+
+    if (!lib_initialized || lib_busy || !dataset_valid_name(name) || data == NULL ||
+        len == 0) {
+        return -1;
+    }
+
+    cache_path = dataset_parse_text(data, len, threads, &parsed_rows, &parsed_columns,
+                                    &cache_fd);
+    if (!cache_path) {
+        return -1;
+    }
+
+    return dataset_store(name, NULL, 0, 0, cache_path, cache_fd, parsed_rows, parsed_columns,
+                         rows, columns);
+}
+
+/* Sample a function or curve into a dataset */
+int gnuplot_dataset_sample(const char *name, const char *xexpr, const char *yexpr,
+                           const char *var, double tmin, double tmax, int samples)
+{
+    double *t, *x, *y, *rows;
+    char *cache_path;
+    FILE *fp;
+    int cache_fd;
+    int i;
+
+    if (!lib_initialized || lib_busy || !dataset_valid_name(name) || yexpr == NULL ||
+        samples < 2) {
+        return -1;
+    }
+
+    t = (double *)malloc(5 * (size_t)samples * sizeof(double));
+    if (!t) {
+        return -1;
+    }
+    x = t + samples;
+    y = x + samples;
+    rows = y + samples;
+
+    for (i = 0; i < samples; i++) {
+        t[i] = tmin + (tmax - tmin) * i / (samples - 1);
+    }
+
+    if (gnuplot_eval_batch(yexpr, var, t, y, samples) != 0 ||
+        (xexpr && gnuplot_eval_batch(xexpr, var, t, x, samples) != 0)) {
+        free(t);
+        return -1;
+    }
+    if (!xexpr) {
+        memcpy(x, t, samples * sizeof(double));
+    }
+
+    /* Row-major x y records, the layout of a parsed dataset. NaN marks an
+     * undefined point; lines are not drawn through it */
+    for (i = 0; i < samples; i++) {
+        rows[2 * i] = x[i];
+        rows[2 * i + 1] = y[i];
+    }
+
+    cache_path = dataset_cache_file(&fp, &cache_fd);
+    if (!cache_path) {
+        free(t);
+        return -1;
+    }
+    if (fwrite(rows, 2 * sizeof(double), samples, fp) != (size_t)samples) {
+        fclose(fp);
+        dataset_cache_drop(cache_path, cache_fd);
+        free(t);
+        return -1;
+    }
+    fclose(fp);
+    free(t);
+
+    return dataset_store(name, NULL, 0, 0, cache_path, cache_fd, samples, 2, NULL, NULL);
+}
+
+/* Drop a dataset and its cache file (name NULL: all datasets) */
+void gnuplot_dataset_free(const char *name)
+{
+    dataset_t **link = &datasets;
+
+    /* A running command may be reading the cache files */
+    if (lib_busy) {
+        return;
+    }
+
+    while (*link) {
+        dataset_t *ds = *link;
+
+        if (name && strcmp(ds->name, name) != 0) {
+            link = &ds->next;
+            continue;
+        }
+
+        *link = ds->next;
+        dataset_cache_drop(ds->cache_path, ds->cache_fd);
+        free(ds->source);
+        free(ds->name);
+        free(ds);
+    }
+}
+
+/* Variable read-back */
+
+/* Copy a gnuplot value into var (var->name is left alone) */
+static void
+var_from_value(gnuplot_var_t *var, struct value *v)
+{
+    var->type = GNUPLOT_VAR_UNDEFINED;
+    var->int_val = 0;
+    var->real = var->imag = 0;
+    var->string = NULL;
+    var->array = NULL;
+    var->size = 0;
+
+    switch (v->type) {
+    case INTGR:
+        var->type = GNUPLOT_VAR_INT;
+        var->int_val = (long long)v->v.int_val;
+        var->real = (double)v->v.int_val;
+        break;
+    case CMPLX:
+        var->real = v->v.cmplx_val.real;
+        var->imag = v->v.cmplx_val.imag;
+        var->type = (var->imag == 0) ? GNUPLOT_VAR_REAL : GNUPLOT_VAR_COMPLEX;
+        break;
+    case STRING:
+        var->type = GNUPLOT_VAR_STRING;
+        var->string = gp_strdup(v->v.string_val ? v->v.string_val : "");
+        break;
+    case ARRAY:
+        var->type = GNUPLOT_VAR_ARRAY;
+        if (v->v.value_array) {
+            size_t i, size = (size_t)udv_array_size(v);
+
+            var->array = (gnuplot_var_t *)gp_alloc((size ? size : 1) * sizeof(gnuplot_var_t),
+                                                   "array copy");
+            var->size = size;
+            for (i = 0; i < size; i++) {
+                var->array[i].name = NULL;
+                var_from_value(&var->array[i], &v->v.value_array[i + 1]);
+            }
+        }
+        break;
+    case DATABLOCK:
+        var->type = GNUPLOT_VAR_DATABLOCK;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Look up a variable by name without creating it */
+static struct udvt_entry *
+lookup_udv(const char *name)
+{
+    struct udvt_entry *udv;
+
+    if (!lib_initialized || name == NULL || *name == '\0') {
+        return NULL;
+    }
+    udv = udv_find(name);
+    if (!udv || udv->udv_value.type == NOTDEFINED) {
+        return NULL;
+    }
+    return udv;
+}
+
+/* Read one variable */
+int gnuplot_get_var(const char *name, gnuplot_var_t *var)
+{
+    struct udvt_entry *udv;
+
+    if (var == NULL) {
+        return -1;
+    }
+
+    udv = lookup_udv(name);
+    var->name = NULL;
+    if (!udv) {
+        struct value none;
+        none.type = NOTDEFINED;
+        var_from_value(var, &none);
+        return -1;
+    }
+
+    var_from_value(var, &udv->udv_value);
+    return (var->type == GNUPLOT_VAR_UNDEFINED) ? -1 : 0;
+}
+
+/* Read all variables with a name prefix */
+gnuplot_var_t* gnuplot_get_vars(const char *prefix, size_t *count)
+{
+    struct udvt_entry *udv;
+    gnuplot_var_t *vars;
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    size_t n = 0;
+
+    if (count == NULL) {
+        return NULL;
+    }
+    *count = 0;
+    if (!lib_initialized) {
+        return NULL;
+    }
+
+    for (udv = first_udv; udv; udv = udv->next_udv) {
+        if (udv->udv_value.type != NOTDEFINED &&
+            strncmp(udv->udv_name, prefix ? prefix : "", prefix_len) == 0) {
+            n++;
+        }
+    }
+    if (n == 0) {
+        return NULL;
+    }
+
+    vars = (gnuplot_var_t *)gp_alloc(n * sizeof(gnuplot_var_t), "variables");
+    n = 0;
+    for (udv = first_udv; udv; udv = udv->next_udv) {
+        if (udv->udv_value.type != NOTDEFINED &&
+            strncmp(udv->udv_name, prefix ? prefix : "", prefix_len) == 0) {
+            vars[n].name = gp_strdup(udv->udv_name);
+            var_from_value(&vars[n], &udv->udv_value);
+            n++;
+        }
+    }
+
+    *count = n;
+    return vars;
+}
+
+/* Release the contents of a variable */
+void gnuplot_var_clear(gnuplot_var_t *var)
+{
+    size_t i;
+
+    if (!var) {
+        return;
+    }
+    for (i = 0; i < var->size; i++) {
+        gnuplot_var_clear(&var->array[i]);
+    }
+    free(var->array);
+    free(var->string);
+    free(var->name);
+    var->array = NULL;
+    var->string = NULL;
+    var->name = NULL;
+    var->size = 0;
+    var->type = GNUPLOT_VAR_UNDEFINED;
+}
+
+/* Release an array of variables */
+void gnuplot_free_vars(gnuplot_var_t *vars, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        gnuplot_var_clear(&vars[i]);
+    }
+    free(vars);
+}
+
+/* Find a datablock; name with or without '$' */
+static char **
+lookup_datablock(const char *name)
+{
+    struct udvt_entry *udv;
+
+    if (name == NULL || name[0] == '\0' || strcmp(name, "$") == 0) {
+        return NULL;
+    }
+    if (name[0] == '$') {
+        udv = lookup_udv(name);
+    } else {
+        char *full = (char *)gp_alloc(strlen(name) + 2, "datablock name");
+        full[0] = '$';
+        strcpy(full + 1, name);
+        udv = lookup_udv(full);
+        free(full);
+    }
+
+    if (!udv || udv->udv_value.type != DATABLOCK) {
+        return NULL;
+    }
+    return udv->udv_value.v.data_array;
+}
+
+/* Copy the lines of a datablock */
+char** gnuplot_get_datablock(const char *name, size_t *count)
+{
+    char **lines;
+    char **copy;
+    char *text;
+    size_t n = 0, bytes = 0, i;
+
+    if (count == NULL) {
+        return NULL;
+    }
+    *count = 0;
+    lines = lookup_datablock(name);
+    if (!lines) {
+        return NULL;
+    }
+
+    for (n = 0; lines[n]; n++) {
+        bytes += strlen(lines[n]) + 1;
+    }
+
+    /* Pointers and text in one block */
+    copy = (char **)gp_alloc((n + 1) * sizeof(char *) + bytes, "datablock copy");
+    text = (char *)(copy + n + 1);
+    for (i = 0; i < n; i++) {
+        size_t len = strlen(lines[i]) + 1;
+        memcpy(text, lines[i], len);
+        copy[i] = text;
+        text += len;
+    }
+    copy[n] = NULL;
+
+    *count = n;
+    return copy;
+}
+
+/* Parse the numbers of a datablock */
+double* gnuplot_get_datablock_values(const char *name, size_t *rows, int *columns)
+{
+    char **lines;
+    char **line, **first = NULL;
+    double *values;
+    size_t n = 0;
+    int ncols = 0, header_checked = 0;
+
+    if (rows == NULL || columns == NULL) {
+        return NULL;
+    }
+    *rows = 0;
+    *columns = 0;
+    lines = lookup_datablock(name);
+    if (!lines) {
+        return NULL;
+    }
+
+    /* Same rules as dataset loading: skip comments and one header line */
+    for (line = lines; *line; line++) {
+        const char *eol = *line + strlen(*line);
+        int fields;
+
+        if (!dataset_data_line(*line, eol)) {
+            continue;
+        }
+        if (!first) {
+            int numbers = dataset_parse_line(*line, eol, NULL, 0, &fields);
+            if (numbers == 0 && !header_checked) {
+                header_checked = 1;
+                continue;
+            }
+            first = line;
+            ncols = fields;
+        }
+        n++;
+    }
+    if (!first || ncols == 0) {
+        return NULL;
+    }
+
+    values = (double *)gp_alloc(n * ncols * sizeof(double), "datablock values");
+    n = 0;
+    for (line = first; *line; line++) {
+        const char *eol = *line + strlen(*line);
+
+        if (dataset_data_line(*line, eol)) {
+            dataset_parse_line(*line, eol, values + n * ncols, ncols, NULL);
+            n++;
+        }
+    }
+
+    *rows = n;
+    *columns = ncols;
+    return values;
+}
+
+/* Initialize memory (simplified version of init_memory from plot.c) */
+static void init_memory_lib(void)
+{
+    extend_input_line();
+    extend_token_table();
+    replot_line = gp_strdup("");
+}
+
+/* Include bitmap functions */
+#include "bitmap.h"
+
+/* Global buffer for saved bitmap data */
+static unsigned char *saved_rgb_data = NULL;
+static unsigned int saved_width = 0;
+static unsigned int saved_height = 0;
+
+/* Save bitmap RGB data - must be called while bitmap still exists */
+void* gnuplot_save_bitmap_data(void)
+{
+    /* Verify we're using PBM terminal */
+    if (!term || !term->name || strcmp(term->name, "pbm") != 0) {
+        return NULL;  /* Not PBM terminal */
+    }
+
+    /* Check if bitmap exists (PBM terminal) */
+    if (!b_p || !(*b_p) || b_xsize == 0 || b_ysize == 0) {
+        return NULL;
+    }
+
+    /* Check if color mode (need 4 planes for RGB) */
+    if (b_planes < 4) {
+        return NULL;
+    }
+
+    unsigned int width = b_ysize;   /* Reversed due to raster mode */
+    unsigned int height = b_xsize;
+
+    /* Calculate buffer size */
+    size_t rgb_size = (size_t)width * height * 3;
+
+    /* Free previous saved data if any */
+    gnuplot_free_saved_pbm_bitmap();
+
+    /* Respect the bitmap limit */
+    if (mem_usage[GNUPLOT_MEM_BITMAP].limit &&
+        sizeof(unsigned int) * 2 + rgb_size > mem_usage[GNUPLOT_MEM_BITMAP].limit) {
+        return NULL;
+    }
+
+    /* Allocate new buffer (with space for width/height header) */
+    saved_rgb_data = (unsigned char *)malloc(sizeof(unsigned int) * 2 + rgb_size);
+    if (!saved_rgb_data) {
+        return NULL;
+    }
+
+    /* Store width and height at start of buffer */
+    ((unsigned int*)saved_rgb_data)[0] = width;
+    ((unsigned int*)saved_rgb_data)[1] = height;
+
+    /* Extract RGB data - same logic as PBM_colortext() */
+    unsigned char *rgb_ptr = saved_rgb_data + sizeof(unsigned int) * 2;
+
+    for (int x = height - 1; x >= 0; x--) {
+        int row = (width / 8) - 1;
+        for (int j = row; j >= 0; j--) {
+            int mask = 0x80;
+            int plane1 = (*((*b_p)[j] + x));
+            int plane2 = (*((*b_p)[j + b_psize] + x));
+            int plane3 = (*((*b_p)[j + b_psize + b_psize] + x));
+            int plane4 = (*((*b_p)[j + b_psize + b_psize + b_psize] + x));
+
+            for (int i = 0; i < 8; i++) {
+                int red = (plane3 & mask) ? 1 : 3;
+                int green = (plane2 & mask) ? 1 : 3;
+                int blue = (plane1 & mask) ? 1 : 3;
+                if (plane4 & mask) {
+                    red--;
+                    green--;
+                    blue--;
+                }
+                /* Scale to 0-255 range (85 = 255/3) */
+                *rgb_ptr++ = (unsigned char)(red * 85);
+                *rgb_ptr++ = (unsigned char)(green * 85);
+                *rgb_ptr++ = (unsigned char)(blue * 85);
+                mask >>= 1;
+            }
+        }
+    }
+
+    saved_width = width;
+    saved_height = height;
+    mem_note(GNUPLOT_MEM_BITMAP, sizeof(unsigned int) * 2 + rgb_size);
+
+    return saved_rgb_data;
+}
+
+/* Get the saved PBM bitmap data (already saved by terminal) */
+void* gnuplot_get_saved_pbm_rgb_data(void)
+{
+    return saved_rgb_data;
+}
+
+/* Free saved PBM bitmap data */
+void gnuplot_free_saved_pbm_bitmap(void)
+{
+    if (saved_rgb_data) {
+        free(saved_rgb_data);
+        saved_rgb_data = NULL;
+        saved_width = 0;
+        saved_height = 0;
+        mem_note(GNUPLOT_MEM_BITMAP, 0);
+    }
+}
+
+/* luacmd terminal command capture implementation */
+/* Command types - must match CMD_* in luacmd.trm */
+#define LUACMD_CMD_MOVE 0
+#define LUACMD_CMD_VECTOR 1
+#define LUACMD_CMD_TEXT 2
+#define LUACMD_CMD_COLOR 3
+#define LUACMD_CMD_LINEWIDTH 4
+#define LUACMD_CMD_LINETYPE 5
+#define LUACMD_CMD_POINT 6
+#define LUACMD_CMD_FILLBOX 7
+#define LUACMD_CMD_FILLED_POLYGON 8
+#define LUACMD_CMD_TEXT_ANGLE 9
+#define LUACMD_CMD_JUSTIFY 10
+#define LUACMD_CMD_SET_FONT 11
+#define LUACMD_CMD_IMAGE 12
+
+static luacmd_command_t *command_buffer = NULL;
+static int command_count = 0;
+static int command_capacity = 0;
+static size_t command_payload_bytes = 0;  /* Text and pixel blocks */
+static int capture_stopped = 0;   /* Capture limit hit, drop until next plot */
+static int capture_overflow = 0;  /* Limit hit by the command being added */
+static int plot_width = 800;
+static int plot_height = 600;
+
+/* Streaming sink (NULL when commands are buffered until retrieved) */
+#define LUACMD_DEFAULT_CHUNK 4096
+static luacmd_sink_t command_sink = NULL;
+static void *command_sink_data = NULL;
+static int command_chunk_size = LUACMD_DEFAULT_CHUNK;
+
+/* Update capture accounting after the buffer or its payload changed */
+static void note_capture_usage(void)
+{
+    mem_note(GNUPLOT_MEM_CAPTURE,
+             command_capacity * sizeof(luacmd_command_t) + command_payload_bytes);
+}
+
+/* Shrink the command buffer to its contents, releasing it when empty */
+static void trim_command_buffer(void)
+{
+    if (command_count == 0) {
+        free(command_buffer);
+        command_buffer = NULL;
+        command_capacity = 0;
+    } else if (command_capacity > command_count) {
+        luacmd_command_t *shrunk = (luacmd_command_t *)realloc(command_buffer,
+                                            command_count * sizeof(luacmd_command_t));
+        if (shrunk) {
+            command_buffer = shrunk;
+            command_capacity = command_count;
+        }
+    }
+    note_capture_usage();
+}
+
+/* Hand the buffered commands to the sink and empty the buffer */
+static void luacmd_flush_sink(int final_chunk)
+{
+    if (!command_sink) {
+        return;
+    }
+
+    if (command_count == 0 && !final_chunk) {
+        return;
+    }
+
+    command_sink(command_buffer, command_count, plot_width, plot_height,
+                 final_chunk, command_sink_data);
+    luacmd_clear_commands();
+}
+
+void luacmd_set_sink(luacmd_sink_t sink, int chunk_size, void *userdata)
+{
+    /* Drop anything captured under the previous mode */
+    luacmd_clear_commands();
+
+    command_sink = sink;
+    command_sink_data = userdata;
+    command_chunk_size = (chunk_size > 0) ? chunk_size : LUACMD_DEFAULT_CHUNK;
+}
+
+void luacmd_begin_plot(int width, int height)
+{
+    plot_width = width;
+    plot_height = height;
+    capture_stopped = 0;
+    luacmd_clear_commands();
+}
+
+void luacmd_end_plot(void)
+{
+    /* Plot is complete, commands are ready to be retrieved */
+    /* or, when streaming, the last batch goes to the sink */
+    luacmd_flush_sink(1);
+}
+
+void luacmd_clear_commands(void)
+{
+    /* Free all text strings and pixel blocks */
+    for (int i = 0; i < command_count; i++) {
+        if (command_buffer[i].text) {
+            free(command_buffer[i].text);
+        }
+        if (command_buffer[i].image) {
+            luacmd_image_release(command_buffer[i].image);
+        }
+        free(command_buffer[i].points);
+    }
+
+    /* Reset count but keep buffer allocated */
+    command_count = 0;
+    command_payload_bytes = 0;
+
+    /* ...unless it is larger than the capture limit allows */
+    if (mem_usage[GNUPLOT_MEM_CAPTURE].limit &&
+        command_capacity * sizeof(luacmd_command_t) > mem_usage[GNUPLOT_MEM_CAPTURE].limit) {
+        trim_command_buffer();
+    }
+    note_capture_usage();
+}
+
+/* Reserve the next command slot for a command holding payload bytes,
+ * growing the buffer if needed. Returns NULL once the capture limit is
+ * reached; the caller frees what it holds and calls capture_checkpoint(). */
+static luacmd_command_t* luacmd_next_command(size_t payload)
+{
+    int capacity;
+
+    if (capture_stopped) {
+        return NULL;
+    }
+
+    capacity = command_capacity;
+    if (command_count >= capacity) {
+        capacity = (capacity == 0) ? 1024 : capacity * 2;
+    }
+    if (mem_usage[GNUPLOT_MEM_CAPTURE].limit &&
+        capacity * sizeof(luacmd_command_t) + command_payload_bytes + payload
+        > mem_usage[GNUPLOT_MEM_CAPTURE].limit) {
+        capture_stopped = 1;
+        capture_overflow = 1;
+        return NULL;
+    }
+
+    /* Grow buffer if needed */
+    if (command_count >= command_capacity) {
+        command_capacity = capacity;
+        command_buffer = (luacmd_command_t *)realloc(command_buffer,
+                                                     command_capacity * sizeof(luacmd_command_t));
+        if (!command_buffer) {
+            command_count = 0;
+            command_capacity = 0;
+            return NULL;
+        }
+    }
+
+    return &command_buffer[command_count++];
+}
+
+/* Error and cancellation point at the end of every luacmd_add_*(), where
+ * nothing is left to leak when the command unwinds */
+static void capture_checkpoint(void)
+{
+    if (capture_overflow) {
+        /* Abandon the plot: release the partial capture and leave graphics
+         * mode as a cancel does, then fail the command */
+        capture_overflow = 0;
+        luacmd_clear_commands();
+        trim_command_buffer();
+        term_end_plot();
+        int_error(NO_CARET, "plot capture exceeds the limit of %lu bytes",
+                  (unsigned long)mem_usage[GNUPLOT_MEM_CAPTURE].limit);
+    }
+
+    /* Also reached when a script switches to luacmd after the command
+     * started, so its drawing calls are not hooked */
+    check_cancel();
+}
+
+void luacmd_add_command(int type, int x1, int y1, int x2, int y2,
+                      const char *text, unsigned int color, double value)
+{
+    luacmd_command_t *cmd = luacmd_next_command(text ? strlen(text) + 1 : 0);
+    if (!cmd) {
+        capture_checkpoint();
+        return;
+    }
+
+    /* Add command */
+    cmd->type = type;
+    cmd->x1 = x1;
+    cmd->y1 = y1;
+    cmd->x2 = x2;
+    cmd->y2 = y2;
+    cmd->text = text ? strdup(text) : NULL;
+    cmd->color = color;
+    cmd->value = value;
+    cmd->image = NULL;
+    cmd->points = NULL;
+
+    if (cmd->text) {
+        command_payload_bytes += strlen(cmd->text) + 1;
+    }
+    note_capture_usage();
+
+    if (command_sink && command_count >= command_chunk_size) {
+        luacmd_flush_sink(0);
+    }
+    capture_checkpoint();
+}
+
+void luacmd_add_image(int x, int y, int width, int height, luacmd_image_t *image)
+{
+    luacmd_command_t *cmd = luacmd_next_command(sizeof(luacmd_image_t) +
+                                                (size_t)image->width * image->height * 4);
+    if (!cmd) {
+        luacmd_image_release(image);
+        capture_checkpoint();
+        return;
+    }
+
+    cmd->type = LUACMD_CMD_IMAGE;
+    cmd->x1 = x;
+    cmd->y1 = y;
+    cmd->x2 = width;
+    cmd->y2 = height;
+    cmd->text = NULL;
+    cmd->color = 0;
+    cmd->value = 0.0;
+    cmd->image = image;
+    cmd->points = NULL;
+
+    command_payload_bytes += sizeof(luacmd_image_t) + (size_t)image->width * image->height * 4;
+    note_capture_usage();
+
+    if (command_sink && command_count >= command_chunk_size) {
+        luacmd_flush_sink(0);
+    }
+    capture_checkpoint();
+}
+
+void luacmd_add_polygon(int n, const int *xy, unsigned int color, int style)
+{
+    luacmd_command_t *cmd;
+    int *points;
+
+    if (n < 1 || !xy) {
+        return;
+    }
+
+    points = (int *)malloc(2 * (size_t)n * sizeof(int));
+    if (!points) {
+        return;
+    }
+    memcpy(points, xy, 2 * (size_t)n * sizeof(int));
+
+    cmd = luacmd_next_command(2 * (size_t)n * sizeof(int));
+    if (!cmd) {
+        free(points);
+        capture_checkpoint();
+        return;
+    }
+
+    /* First corner and count as before, for renderers that ignore points */
+    cmd->type = LUACMD_CMD_FILLED_POLYGON;
+    cmd->x1 = xy[0];
+    cmd->y1 = xy[1];
+    cmd->x2 = n;
+    cmd->y2 = 0;
+    cmd->text = NULL;
+    cmd->color = color;
+    cmd->value = (double)style;
+    cmd->image = NULL;
+    cmd->points = points;
+
+    command_payload_bytes += 2 * (size_t)n * sizeof(int);
+    note_capture_usage();
+
+    if (command_sink && command_count >= command_chunk_size) {
+        luacmd_flush_sink(0);
+    }
+    capture_checkpoint();
+}
+
+luacmd_image_t* luacmd_image_create(unsigned int width, unsigned int height)
+{
+    luacmd_image_t *image;
+
+    if (width == 0 || height == 0) {
+        return NULL;
+    }
+
+    image = (luacmd_image_t *)malloc(sizeof(luacmd_image_t));
+    if (!image) {
+        return NULL;
+    }
+
+    image->rgba = (unsigned char *)malloc((size_t)width * height * 4);
+    if (!image->rgba) {
+        free(image);
+        return NULL;
+    }
+
+    image->refcount = 1;
+    image->width = width;
+    image->height = height;
+    return image;
+}
+
+void luacmd_image_retain(luacmd_image_t *image)
+{
+    if (image) {
+        image->refcount++;
+    }
+}
+
+void luacmd_image_release(luacmd_image_t *image)
+{
+    if (image && --image->refcount == 0) {
+        free(image->rgba);
+        free(image);
+    }
+}
+
+luacmd_command_t* luacmd_get_commands(int *count, int *width, int *height)
+{
+    *count = command_count;
+    *width = plot_width;
+    *height = plot_height;
+
+    /* Return copy of commands */
+    if (command_count == 0) {
+        return NULL;
+    }
+
+    luacmd_command_t *copy = (luacmd_command_t *)malloc(command_count * sizeof(luacmd_command_t));
+    if (!copy) {
+        return NULL;
+    }
+
+    for (int i = 0; i < command_count; i++) {
+        copy[i] = command_buffer[i];
+        /* Duplicate text strings */
+        copy[i].text = command_buffer[i].text ? strdup(command_buffer[i].text) : NULL;
+        /* Pixel blocks are shared, not copied */
+        luacmd_image_retain(copy[i].image);
+        if (command_buffer[i].points) {
+            size_t len = 2 * (size_t)command_buffer[i].x2 * sizeof(int);
+            copy[i].points = (int *)malloc(len);
+            if (copy[i].points) {
+                memcpy(copy[i].points, command_buffer[i].points, len);
+            }
+        }
+    }
+
+    return copy;
+}
+
+void luacmd_free_commands(luacmd_command_t *commands)
+{
+    if (!commands) {
+        return;
+    }
+
+    /* Note: We don't know the count here, but in practice this function
+     * won't be used - Lua will manage the memory */
+    free(commands);
+}
+
+/* Replay of captured commands through another terminal
+ * Each command maps onto the matching termentry callback; only the
+ * coordinates change, from the flipped luacmd canvas to the target's.
+ * A replay may cover only a band of the capture (see gnuplot_render_strips),
+ * so geometry is clipped to the target canvas before it is drawn.
+ */
+
+/* Terminal and output state replaced while replaying */
+static int replay_pushed = 0;
+static int replay_output_open = 0;
+static FILE *replay_saved_file = NULL;
+static char *replay_saved_outstr = NULL;
+
+/* Map from the replayed region of the capture to the target terminal */
+static double replay_sx, replay_sy;
+static double replay_left, replay_bottom;
+
+static double
+replay_x(double x)
+{
+    return (x - replay_left) * replay_sx;
+}
+
+static double
+replay_y(double y)
+{
+    return (replay_bottom - y) * replay_sy;
+}
+
+/* Round a target coordinate already inside the canvas */
+static unsigned int
+replay_coord(double v)
+{
+    return v > 0 ? (unsigned int)(v + 0.5) : 0;
+}
+
+/* Anchors of text and points may lie a little outside the canvas and still
+ * draw partly inside it; terminals clip those pixels themselves */
+static int
+replay_near_canvas(double x, double y, double margin)
+{
+    return x >= -margin && x <= term->xmax + margin &&
+           y >= -margin && y <= term->ymax + margin;
+}
+
+/* Clip a segment to the canvas (Liang-Barsky)
+ * Returns 0 if nothing of it is visible */
+static int
+replay_clip_line(double *x0, double *y0, double *x1, double *y1)
+{
+    double dx = *x1 - *x0, dy = *y1 - *y0;
+    double p[4], q[4];
+    double t0 = 0, t1 = 1;
+    int i;
+
+    p[0] = -dx; q[0] = *x0;
+    p[1] = dx;  q[1] = term->xmax - *x0;
+    p[2] = -dy; q[2] = *y0;
+    p[3] = dy;  q[3] = term->ymax - *y0;
+
+    for (i = 0; i < 4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0) {
+                return 0;
+            }
+        } else {
+            double t = q[i] / p[i];
+            if (p[i] < 0) {
+                if (t > t1) return 0;
+                if (t > t0) t0 = t;
+            } else {
+                if (t < t0) return 0;
+                if (t < t1) t1 = t;
+            }
+        }
+    }
+
+    *x1 = *x0 + t1 * dx;
+    *y1 = *y0 + t1 * dy;
+    *x0 = *x0 + t0 * dx;
+    *y0 = *y0 + t0 * dy;
+    return 1;
+}
+
+/* Clip a polygon against one canvas edge (Sutherland-Hodgman)
+ * edge: 0 = left, 1 = right, 2 = bottom, 3 = top. out needs 2 * n points */
+static int
+replay_clip_edge(const double *in, int n, double *out, int edge)
+{
+    double limit = (edge == 1) ? term->xmax : (edge == 3) ? term->ymax : 0;
+    int axis = edge / 2;
+    int m = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        const double *a = &in[2 * i];
+        const double *b = &in[2 * ((i + 1) % n)];
+        double da = (edge & 1) ? limit - a[axis] : a[axis] - limit;
+        double db = (edge & 1) ? limit - b[axis] : b[axis] - limit;
+
+        if (da >= 0) {
+            out[2 * m] = a[0];
+            out[2 * m + 1] = a[1];
+            m++;
+        }
+        if ((da >= 0) != (db >= 0)) {
+            double t = da / (da - db);
+            out[2 * m] = a[0] + t * (b[0] - a[0]);
+            out[2 * m + 1] = a[1] + t * (b[1] - a[1]);
+            m++;
+        }
+    }
+    return m;
+}
+
+static void
+replay_color(unsigned int rgb)
+{
+    t_colorspec color;
+
+    if (!term->set_color) {
+        return;
+    }
+    memset(&color, 0, sizeof(color));
+    color.type = TC_RGB;
+    color.lt = (int)rgb;
+    term->set_color(&color);
+}
+
+/* Fill the part of a target rectangle that lies on the canvas */
+static void
+replay_fillbox(int style, double x0, double y0, double x1, double y1)
+{
+    unsigned int left, bottom, right, top;
+
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > term->xmax) x1 = term->xmax;
+    if (y1 > term->ymax) y1 = term->ymax;
+
+    left = replay_coord(x0);
+    bottom = replay_coord(y0);
+    right = replay_coord(x1);
+    top = replay_coord(y1);
+    if (right > left && top > bottom) {
+        term->fillbox(style, left, bottom, right - left, top - bottom);
+    }
+}
+
+/* Draw an image command, one box per pixel if the terminal has no image() */
+static void
+replay_image(const luacmd_command_t *cmd, unsigned int current_color)
+{
+    const luacmd_image_t *image = cmd->image;
+    unsigned int M = image->width, N = image->height;
+    const unsigned char *p = image->rgba;
+    unsigned int i, j;
+
+    /* Nothing of it in this part of the capture */
+    if (replay_y(cmd->y1) < 0 || replay_y(cmd->y1 + cmd->y2) > term->ymax) {
+        return;
+    }
+
+    if (term->image) {
+        coordval *pixels = (coordval *)gp_alloc((size_t)M * N * 4 * sizeof(coordval),
+                                                "replay image");
+        coordval *q = pixels;
+        gpiPoint corner[4];
+
+        for (i = 0; i < M * N; i++, p += 4) {
+            *q++ = p[0] / 255.0;
+            *q++ = p[1] / 255.0;
+            *q++ = p[2] / 255.0;
+            *q++ = p[3];  /* Alpha is expected on a 0..255 scale */
+        }
+
+        /* corner[2] and corner[3] are the clip area */
+        memset(corner, 0, sizeof(corner));
+        corner[0].x = (int)floor(replay_x(cmd->x1) + 0.5);
+        corner[0].y = (int)floor(replay_y(cmd->y1) + 0.5);
+        corner[1].x = (int)floor(replay_x(cmd->x1 + cmd->x2) + 0.5);
+        corner[1].y = (int)floor(replay_y(cmd->y1 + cmd->y2) + 0.5);
+        corner[2].x = corner[0].x > 0 ? corner[0].x : 0;
+        corner[2].y = corner[0].y < (int)term->ymax ? corner[0].y : (int)term->ymax;
+        corner[3].x = corner[1].x < (int)term->xmax ? corner[1].x : (int)term->xmax;
+        corner[3].y = corner[1].y > 0 ? corner[1].y : 0;
+        term->image(M, N, pixels, corner, IC_RGBA);
+        free(pixels);
+        return;
+    }
+
+    for (j = 0; j < N; j++, p += 4 * M) {
+        double top = replay_y(cmd->y1 + (double)cmd->y2 * j / N);
+        double bottom = replay_y(cmd->y1 + (double)cmd->y2 * (j + 1) / N);
+
+        if (bottom > term->ymax || top < 0) {
+            continue;
+        }
+        for (i = 0; i < M; i++) {
+            const unsigned char *px = p + 4 * i;
+
+            if (px[3] < 128) {
+                continue;
+            }
+            replay_color(((unsigned int)px[0] << 16) | (px[1] << 8) | px[2]);
+            replay_fillbox(FS_OPAQUE,
+                           replay_x(cmd->x1 + (double)cmd->x2 * i / M), bottom,
+                           replay_x(cmd->x1 + (double)cmd->x2 * (i + 1) / M), top);
+        }
+    }
+    replay_color(current_color);
+}
+
+/* Draw a filled polygon clipped to the canvas */
+static void
+replay_polygon(const luacmd_command_t *cmd)
+{
+    int n = cmd->x2;
+    /* Each edge at most doubles the corners */
+    double *buffer = (double *)gp_alloc(2 * 2 * 16 * (size_t)n * sizeof(double),
+                                        "replay polygon");
+    double *a = buffer;
+    double *b = buffer + 2 * 16 * (size_t)n;
+    double *t;
+    gpiPoint *corners;
+    int edge, k;
+
+    for (k = 0; k < n; k++) {
+        a[2 * k] = replay_x(cmd->points[2 * k]);
+        a[2 * k + 1] = replay_y(cmd->points[2 * k + 1]);
+    }
+
+    for (edge = 0; edge < 4 && n > 0; edge++) {
+        n = replay_clip_edge(a, n, b, edge);
+        t = a;
+        a = b;
+        b = t;
+    }
+
+    if (n >= 3) {
+        corners = (gpiPoint *)gp_alloc(n * sizeof(gpiPoint), "replay polygon");
+        for (k = 0; k < n; k++) {
+            corners[k].x = replay_coord(a[2 * k]);
+            corners[k].y = replay_coord(a[2 * k + 1]);
+            corners[k].style = 0;
+        }
+        corners[0].style = (int)cmd->value;
+        term->filled_polygon(n, corners);
+        free(corners);
+    }
+    free(buffer);
+}
+
+/* Drive the current terminal with the captured commands
+ * order: indices of the commands to replay, in capture order (NULL = all) */
+static void
+replay_commands(const luacmd_command_t *commands, const int *order, int count)
+{
+    unsigned int pen_x = 0, pen_y = 0;
+    int pen_valid = 0;
+    unsigned int current_color = 0;
+    int justify = LEFT;
+    double point_margin = term->v_tic * pointsize * 2 + term->v_char;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const luacmd_command_t *cmd = &commands[order ? order[i] : i];
+
+        /* Skipped commands may have moved the pen */
+        if (order && i > 0 && order[i] != order[i - 1] + 1) {
+            pen_valid = 0;
+        }
+
+        switch (cmd->type) {
+        case LUACMD_CMD_MOVE:
+            /* Vectors move the pen themselves once they are clipped */
+            pen_valid = 0;
+            break;
+
+        case LUACMD_CMD_VECTOR: {
+            /* Vectors carry their start point; only move when it is elsewhere */
+            double x0 = replay_x(cmd->x2), y0 = replay_y(cmd->y2);
+            double x1 = replay_x(cmd->x1), y1 = replay_y(cmd->y1);
+            unsigned int from_x, from_y;
+
+            if (!replay_clip_line(&x0, &y0, &x1, &y1)) {
+                pen_valid = 0;
+                break;
+            }
+            from_x = replay_coord(x0);
+            from_y = replay_coord(y0);
+            if (!pen_valid || from_x != pen_x || from_y != pen_y) {
+                term->move(from_x, from_y);
+            }
+            pen_x = replay_coord(x1);
+            pen_y = replay_coord(y1);
+            pen_valid = 1;
+            term->vector(pen_x, pen_y);
+            break;
+        }
+
+        case LUACMD_CMD_TEXT: {
+            double x = replay_x(cmd->x1), y = replay_y(cmd->y1);
+            double length;
+
+            if (!cmd->text) {
+                break;
+            }
+            length = (double)term->h_char * strlen(cmd->text);
+            if (!replay_near_canvas(x, y, length + term->v_char)) {
+                break;
+            }
+            /* Same fallback as gnuplot for terminals that cannot justify */
+            if (justify != LEFT &&
+                (!term->justify_text || !term->justify_text((enum JUSTIFY)justify))) {
+                x -= (justify == CENTRE) ? length / 2 : length;
+            }
+            /* Out-of-range anchors wrap; terminals drop pixels off the canvas */
+            term->put_text((unsigned int)(int)floor(x + 0.5),
+                           (unsigned int)(int)floor(y + 0.5), cmd->text);
+            break;
+        }
+
+        case LUACMD_CMD_COLOR:
+            current_color = cmd->color;
+            replay_color(current_color);
+            break;
+
+        case LUACMD_CMD_LINEWIDTH:
+            if (term->linewidth) {
+                term->linewidth(cmd->value);
+            }
+            break;
+
+        case LUACMD_CMD_LINETYPE:
+            term->linetype(cmd->x1);
+            break;
+
+        case LUACMD_CMD_POINT: {
+            double x = replay_x(cmd->x1), y = replay_y(cmd->y1);
+
+            if (replay_near_canvas(x, y, point_margin)) {
+                term->point((unsigned int)(int)floor(x + 0.5),
+                            (unsigned int)(int)floor(y + 0.5), (int)cmd->value);
+            }
+            break;
+        }
+
+        case LUACMD_CMD_FILLBOX:
+            /* Captured with the top edge; terminals expect the bottom one */
+            if (term->fillbox) {
+                replay_fillbox((int)cmd->value,
+                               replay_x(cmd->x1), replay_y(cmd->y1 + cmd->y2),
+                               replay_x(cmd->x1 + cmd->x2), replay_y(cmd->y1));
+            }
+            break;
+
+        case LUACMD_CMD_FILLED_POLYGON:
+            /* Captures from before corners were stored cannot be replayed */
+            if (term->filled_polygon && cmd->points && cmd->x2 > 0) {
+                replay_polygon(cmd);
+            }
+            break;
+
+        case LUACMD_CMD_TEXT_ANGLE:
+            term->text_angle((float)cmd->value);
+            break;
+
+        case LUACMD_CMD_JUSTIFY:
+            justify = cmd->x1;
+            if (term->justify_text) {
+                term->justify_text((enum JUSTIFY)justify);
+            }
+            break;
+
+        case LUACMD_CMD_SET_FONT:
+            term->set_font(cmd->text ? cmd->text : "");
+            break;
+
+        case LUACMD_CMD_IMAGE:
+            if (cmd->image && cmd->x2 > 0 && cmd->y2 > 0) {
+                replay_image(cmd, current_color);
+            }
+            break;
+        }
+    }
+}
+
+/* Undo the terminal and output changes of replay_region() */
+static void
+replay_restore(void)
+{
+    if (replay_output_open) {
+        replay_output_open = 0;
+        term_set_output(NULL);  /* Resets the terminal and closes the file */
+        gpoutfile = replay_saved_file;
+        outstr = replay_saved_outstr;
+    }
+    if (replay_pushed) {
+        replay_pushed = 0;
+        do_string("set term pop");
+    }
+}
+
+/* Replay the region left, top, width x height of a capture (in luacmd
+ * coordinates) onto the whole canvas of 'set terminal terminal_spec'
+ * order, count: as for replay_commands() */
+static int
+replay_region(const luacmd_command_t *commands, const int *order, int count,
+              double left, double top, double width, double height,
+              const char *terminal_spec, const char *output)
+{
+    luacmd_command_t *saved_buffer;
+    int saved_count, saved_capacity;
+    size_t saved_payload;
+    char *set_term;
+    int result;
+
+    if (lib_busy) {
+        return -1;
+    }
+
+    /* Leaving luacmd resets it, which would discard the live capture */
+    saved_buffer = command_buffer;
+    saved_count = command_count;
+    saved_capacity = command_capacity;
+    saved_payload = command_payload_bytes;
+    command_buffer = NULL;
+    command_count = 0;
+    command_capacity = 0;
+    command_payload_bytes = 0;
+
+    set_term = (char *)gp_alloc(strlen(terminal_spec) + 16, "replay terminal");
+    sprintf(set_term, "set terminal %s", terminal_spec);
+
+    lib_busy = 1;
+    if (!SETJMP(lib_command_line_env, 1)) {
+        do_string("set term push");
+        replay_pushed = 1;
+        do_string(set_term);
+
+        /* Keep the current output open rather than closing it */
+        replay_saved_file = gpoutfile;
+        replay_saved_outstr = outstr;
+        gpoutfile = stdout;
+        outstr = NULL;
+        replay_output_open = 1;
+        term_set_output(gp_strdup(output));
+
+        term_start_plot();
+        replay_sx = (double)term->xmax / width;
+        replay_sy = (double)term->ymax / height;
+        replay_left = left;
+        replay_bottom = top + height;
+        replay_commands(commands, order, count);
+
+        /* Keep the pbm bitmap for gnuplot_get_saved_pbm_rgb_data() */
+        hook_terminal_text();
+        term_end_plot();
+
+        replay_restore();
+        result = 0;
+    } else {
+        unhook_terminal_text();
+        if (!SETJMP(lib_command_line_env, 1)) {
+            term_end_plot();
+            replay_restore();
+        } else {
+            if (replay_output_open) {
+                gpoutfile = replay_saved_file;
+                outstr = replay_saved_outstr;
+            }
+            replay_output_open = 0;
+            replay_pushed = 0;
+        }
+        result = -1;
+    }
+    lib_busy = 0;
+    free(set_term);
+
+    /* Put the capture back, dropping whatever the restored terminal left */
+    luacmd_clear_commands();
+    free(command_buffer);
+    command_buffer = saved_buffer;
+    command_count = saved_count;
+    command_capacity = saved_capacity;
+    command_payload_bytes = saved_payload;
+    note_capture_usage();
+
+    return result;
+}
+
+int luacmd_replay(const luacmd_command_t *commands, int count,
+                  int width, int height,
+                  const char *terminal_spec, const char *output)
+{
+    if (!lib_initialized || !terminal_spec || !output ||
+        width <= 0 || height <= 0 || count < 0 || (count > 0 && !commands)) {
+        return -1;
+    }
+
+    return replay_region(commands, NULL, count, 0, 0, width, height,
+                         terminal_spec, output);
+}
+
+/* Strip-tiled raster rendering
+ * The plot is captured once with luacmd at full size, then each band is
+ * replayed into a pbm bitmap only strip_height rows tall. Neither the
+ * full-size bitmap nor a full-size RGB copy ever exists.
+ *
+ * The capture is bucketed by strip up front, so a strip replays only the
+ * drawing commands whose vertical extent meets it, each preceded by the
+ * latest color, line and text settings it has not replayed yet.
+ */
+#ifdef _WIN32
+#define STRIP_NULL_OUTPUT "NUL"
+#else
+#define STRIP_NULL_OUTPUT "/dev/null"
+#endif
+
+#define STRIP_STATE_KINDS 6
+
+typedef struct {
+    int *order;                 /* Command indices to replay, ascending */
+    int count, capacity;
+    int state[STRIP_STATE_KINDS];  /* Last setting of each kind queued */
+} strip_bucket_t;
+
+/* Kind of setting a command changes, -1 for drawing commands */
+static int
+strip_state_kind(int type)
+{
+    switch (type) {
+    case LUACMD_CMD_COLOR:      return 0;
+    case LUACMD_CMD_LINEWIDTH:  return 1;
+    case LUACMD_CMD_LINETYPE:   return 2;
+    case LUACMD_CMD_TEXT_ANGLE: return 3;
+    case LUACMD_CMD_JUSTIFY:    return 4;
+    case LUACMD_CMD_SET_FONT:   return 5;
+    default:                    return -1;
+    }
+}
+
+/* Vertical extent of a drawing command in capture coordinates, widened by
+ * margin (line widths, point symbols) and text_char per character of text
+ * (the target font may be larger than luacmd's, and text may be rotated)
+ * Returns 0 for commands that draw nothing */
+static int
+strip_command_extent(const luacmd_command_t *cmd, double margin, double text_char,
+                     double *top, double *bottom)
+{
+    int k;
+
+    switch (cmd->type) {
+    case LUACMD_CMD_VECTOR:
+        *top = (cmd->y1 < cmd->y2) ? cmd->y1 : cmd->y2;
+        *bottom = (cmd->y1 < cmd->y2) ? cmd->y2 : cmd->y1;
+        break;
+    case LUACMD_CMD_TEXT:
+        if (!cmd->text) {
+            return 0;
+        }
+        margin += text_char * (strlen(cmd->text) + 1);
+        *top = *bottom = cmd->y1;
+        break;
+    case LUACMD_CMD_POINT:
+        *top = *bottom = cmd->y1;
+        break;
+    case LUACMD_CMD_FILLBOX:
+    case LUACMD_CMD_IMAGE:
+        *top = cmd->y1;
+        *bottom = cmd->y1 + cmd->y2;
+        break;
+    case LUACMD_CMD_FILLED_POLYGON:
+        if (!cmd->points || cmd->x2 <= 0) {
+            return 0;
+        }
+        *top = *bottom = cmd->points[1];
+        for (k = 1; k < cmd->x2; k++) {
+            double y = cmd->points[2 * k + 1];
+            if (y < *top) *top = y;
+            if (y > *bottom) *bottom = y;
+        }
+        break;
+    default:
+        return 0;
+    }
+
+    *top -= margin;
+    *bottom += margin;
+    return 1;
+}
+
+static int
+strip_push(strip_bucket_t *bucket, int index)
+{
+    if (bucket->count == bucket->capacity) {
+        int capacity = bucket->capacity ? bucket->capacity * 2 : 256;
+        int *order = (int *)realloc(bucket->order, capacity * sizeof(int));
+
+        if (!order) {
+            return -1;
+        }
+        bucket->order = order;
+        bucket->capacity = capacity;
+    }
+    bucket->order[bucket->count++] = index;
+    return 0;
+}
+
+static void
+strip_free_buckets(strip_bucket_t *buckets, int nstrips)
+{
+    int s;
+
+    for (s = 0; s < nstrips; s++) {
+        free(buckets[s].order);
+    }
+    free(buckets);
+}
+
+/* Sort a capture into nstrips bands of strip_height rows
+ * Returns the buckets, or NULL when out of memory */
+static strip_bucket_t *
+strip_build_buckets(const luacmd_command_t *commands, int count, int nstrips,
+                    int strip_height, double margin, double text_char)
+{
+    strip_bucket_t *buckets;
+    int latest[STRIP_STATE_KINDS];
+    int i, k, s;
+
+    buckets = (strip_bucket_t *)calloc(nstrips, sizeof(strip_bucket_t));
+    if (!buckets) {
+        return NULL;
+    }
+    for (k = 0; k < STRIP_STATE_KINDS; k++) {
+        latest[k] = -1;
+        for (s = 0; s < nstrips; s++) {
+            buckets[s].state[k] = -1;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        double top, bottom;
+        int first, last;
+
+        k = strip_state_kind(commands[i].type);
+        if (k >= 0) {
+            latest[k] = i;
+            continue;
+        }
+        if (!strip_command_extent(&commands[i], margin, text_char, &top, &bottom) ||
+            bottom < 0 || top >= (double)nstrips * strip_height) {
+            continue;
+        }
+        first = (top < 0) ? 0 : (int)(top / strip_height);
+        last = (int)(bottom / strip_height);
+        if (last >= nstrips) {
+            last = nstrips - 1;
+        }
+
+        for (s = first; s <= last; s++) {
+            strip_bucket_t *bucket = &buckets[s];
+            int pending[STRIP_STATE_KINDS];
+            int n = 0, j;
+
+            /* Settings changed since this strip last drew, in capture order
+             * (a linetype may override an earlier color) */
+            for (k = 0; k < STRIP_STATE_KINDS; k++) {
+                if (latest[k] > bucket->state[k]) {
+                    bucket->state[k] = latest[k];
+                    for (j = n++; j > 0 && pending[j - 1] > latest[k]; j--) {
+                        pending[j] = pending[j - 1];
+                    }
+                    pending[j] = latest[k];
+                }
+            }
+            for (j = 0; j < n; j++) {
+                if (strip_push(bucket, pending[j]) != 0) {
+                    strip_free_buckets(buckets, nstrips);
+                    return NULL;
+                }
+            }
+            if (strip_push(bucket, i) != 0) {
+                strip_free_buckets(buckets, nstrips);
+                return NULL;
+            }
+        }
+    }
+
+    return buckets;
+}
+
+int gnuplot_render_strips(const char *script, int width, int height,
+                          int strip_height, gnuplot_strip_sink_t sink,
+                          void *userdata)
+{
+    luacmd_command_t *saved_buffer, *commands;
+    int saved_count, saved_capacity, count;
+    size_t saved_payload, payload;
+    luacmd_sink_t saved_sink;
+    strip_bucket_t *buckets;
+    double margin, text_char;
+    char spec[64];
+    int nstrips, strip, y, result = -1;
+
+    if (!lib_initialized || !script || !sink || width <= 0 || height <= 0 ||
+        lib_busy) {
+        return -1;
+    }
+
+    /* The pbm bitmap rounds its rows up to whole bytes; keep strips exact */
+    if (strip_height <= 0) {
+        strip_height = 256;
+    }
+    strip_height = (strip_height + 7) & ~7;
+
+    /* Capture into a fresh buffer, without streaming to a registered sink */
+    saved_buffer = command_buffer;
+    saved_count = command_count;
+    saved_capacity = command_capacity;
+    saved_payload = command_payload_bytes;
+    saved_sink = command_sink;
+    command_buffer = NULL;
+    command_count = 0;
+    command_capacity = 0;
+    command_payload_bytes = 0;
+    command_sink = NULL;
+
+    snprintf(spec, sizeof(spec), "set terminal luacmd size %d,%d", width, height);
+    if (gnuplot_cmd("set term push") != 0) {
+        goto restore;
+    }
+    if (gnuplot_cmd(spec) != 0 ||
+        gnuplot_run_script(script, strlen(script)) != 0) {
+        gnuplot_cmd("set term pop");
+        goto restore;  /* Drops whatever was captured */
+    }
+
+    /* Culling margins in luacmd units, doubled for larger target fonts */
+    margin = term->v_tic * pointsize * 2 + term->v_char;
+    text_char = 2.0 * ((term->h_char > term->v_char) ? term->h_char : term->v_char);
+
+    /* Take the capture over before switching back resets luacmd */
+    commands = command_buffer;
+    count = command_count;
+    payload = command_payload_bytes;
+    command_buffer = NULL;
+    command_count = 0;
+    command_capacity = 0;
+    command_payload_bytes = 0;
+    gnuplot_cmd("set term pop");
+
+    /* Each strip must find only its own bitmap */
+    gnuplot_free_saved_pbm_bitmap();
+
+    nstrips = (height + strip_height - 1) / strip_height;
+    buckets = strip_build_buckets(commands, count, nstrips, strip_height, margin, text_char);
+
+    snprintf(spec, sizeof(spec), "pbm color size %d,%d", width, strip_height);
+    result = buckets ? 0 : -1;
+    for (strip = 0; strip < nstrips && result == 0; strip++) {
+        unsigned int *header;
+        unsigned char *rgb;
+        int rows;
+
+        y = strip * strip_height;
+        rows = (height - y < strip_height) ? height - y : strip_height;
+        if (replay_region(commands, buckets[strip].order, buckets[strip].count,
+                          0, y, width, strip_height, spec, STRIP_NULL_OUTPUT) != 0) {
+            result = -1;
+            break;
+        }
+
+        header = (unsigned int *)gnuplot_get_saved_pbm_rgb_data();
+        if (!header || header[0] < (unsigned int)width || header[1] < (unsigned int)rows) {
+            result = -1;
+            break;
+        }
+
+        /* The bitmap rounds its width up to whole bytes, padding the end
+         * of each row; pack the rows to the requested width */
+        rgb = (unsigned char *)(header + 2);
+        if (header[0] != (unsigned int)width) {
+            int r;
+
+            for (r = 1; r < rows; r++) {
+                memmove(rgb + (size_t)r * width * 3, rgb + (size_t)r * header[0] * 3,
+                        (size_t)width * 3);
+            }
+        }
+
+        /* Rows come top to bottom; a short last strip is cut from the top */
+        if (sink(rgb, width, y, rows, userdata) != 0) {
+            result = 1;  /* Stopped by the sink, not an error */
+        }
+        gnuplot_free_saved_pbm_bitmap();
+    }
+    gnuplot_free_saved_pbm_bitmap();
+    if (buckets) {
+        strip_free_buckets(buckets, nstrips);
+    }
+
+    /* Free the capture through the buffer it came from */
+    command_buffer = commands;
+    command_count = count;
+    command_capacity = count;
+    command_payload_bytes = payload;
+
+restore:
+    luacmd_clear_commands();
+    free(command_buffer);
+    command_buffer = saved_buffer;
+    command_count = saved_count;
+    command_capacity = saved_capacity;
+    command_payload_bytes = saved_payload;
+    command_sink = saved_sink;
+    note_capture_usage();
+
+    return result;
+}
+
+/* Work done after every command or script */
+static void mem_after_command(void)
+{
+    if (mem_trim_enabled) {
+        trim_command_buffer();
+    }
+}
+
+/* Get memory usage of a subsystem */
+int gnuplot_mem_usage(int subsystem, gnuplot_mem_usage_t *usage)
+{
+    if (subsystem < 0 || subsystem >= GNUPLOT_MEM_COUNT || !usage) {
+        return -1;
+    }
+
+    if ((subsystem == GNUPLOT_MEM_DATABLOCK || subsystem == GNUPLOT_MEM_UDV) &&
+        mem_vars_stale) {
+        mem_scan_variables();
+    }
+
+    *usage = mem_usage[subsystem];
+    return 0;
+}
+
+/* Set a memory limit */
+int gnuplot_mem_set_limit(int subsystem, size_t limit)
+{
+    if (subsystem < 0 || subsystem >= GNUPLOT_MEM_COUNT) {
+        return -1;
+    }
+
+    mem_usage[subsystem].limit = limit;
+    return 0;
+}
+
+/* Enable or disable trimming after every command */
+void gnuplot_mem_set_trim(int enable)
+{
+    mem_trim_enabled = enable;
+}
+
+/* Release unused capacity */
+void gnuplot_mem_trim(void)
+{
+    trim_command_buffer();
+}
+
+/* Restart high-water tracking */
+void gnuplot_mem_reset_high_water(void)
+{
+    for (int i = 0; i < GNUPLOT_MEM_COUNT; i++) {
+        mem_usage[i].high_water = mem_usage[i].current;
+    }
 }
@@ -8,6 +8,10 @@
 #ifndef LIBGNUPLOT_H
 #define LIBGNUPLOT_H
 
+#include <stddef.h>
+
+#include "luacmd_image.h"
+
 /* DLL export/import declarations for Windows */
 #if defined(_WIN32) || defined(__CYGWIN__)
   #ifdef BUILDING_GNUPLOT_DLL
@@ -40,6 +44,35 @@ GNUPLOT_API int gnuplot_cmd(const char *command);
  */
 GNUPLOT_API int gnuplot_cmd_multi(const char *commands);
 
+/* Execute a complete script held in memory
+ * The buffer is read by gnuplot's own file loader in a single pass, so
+ * heredoc datablocks, continuation lines and if/do blocks behave exactly
+ * as they do in a script file. The buffer need not be NUL-terminated.
+ * Returns 0 on success, non-zero on error (execution stops at the error)
+ */
+GNUPLOT_API int gnuplot_run_script(const char *script, size_t len);
+
+/* Returned instead of -1 when a command was cancelled */
+#define GNUPLOT_CANCELLED -2
+
+/* Execute a command, cancelling it once timeout_ms milliseconds have passed
+ * A timeout of 0 returns GNUPLOT_CANCELLED without running the command.
+ * Returns 0 on success, GNUPLOT_CANCELLED if the deadline expired,
+ * -1 on other errors
+ */
+GNUPLOT_API int gnuplot_cmd_with_deadline(const char *command, unsigned int timeout_ms);
+
+/* Cancel the command currently running in gnuplot_cmd(),
+ * gnuplot_cmd_with_deadline() or gnuplot_run_script()
+ * Safe to call from another thread or a signal handler. Cancellation is
+ * cooperative: the command stops at its next function sample, data line or
+ * drawing call, ends the plot and fails through gnuplot's error path
+ * (GPVAL_ERRMSG is "command cancelled"), returning GNUPLOT_CANCELLED.
+ * A cancel made while no command is running is ignored, so one that
+ * arrives late never stops the next command.
+ */
+GNUPLOT_API void gnuplot_cancel(void);
+
 /* Reset gnuplot to initial state */
 GNUPLOT_API void gnuplot_reset(void);
 
@@ -62,6 +95,146 @@ GNUPLOT_API int gnuplot_is_initialized(void);
  */
 GNUPLOT_API int gnuplot_set_datablock(const char *name, const char *data);
 
+/* Evaluate an expression for many values of one variable
+ * expr: gnuplot expression, e.g. "sin(x)/x"
+ * var:  name of the variable in expr (NULL = "x")
+ * Common arithmetic and builtins (sin, cos, exp, log, sqrt, ...) are run
+ * over blocks of samples at once; other expressions fall back to gnuplot's
+ * evaluator sample by sample. Points gnuplot would treat as undefined
+ * (complex results, division by zero, overflow) are NaN.
+ * Returns 0 on success, non-zero on error (e.g. a syntax error)
+ */
+GNUPLOT_API int gnuplot_eval_batch(const char *expr, const char *var,
+                                   const double *in, double *out, size_t n);
+
+/* Load a large numeric text file (CSV or whitespace separated) once
+ * The text is split into line-aligned chunks that are parsed on several
+ * threads into a row-major binary cache file of doubles (opt-in: plots of
+ * a file name or datablock keep using gnuplot's text reader). The string
+ * variable name is set to a data source for that cache, so plots read
+ * binary records instead of converting text again on every replot:
+ *     gnuplot_dataset_load("LOG", "big.csv", 0, NULL, NULL);
+ *     gnuplot_cmd("plot @LOG using 1:3 with lines");
+ * Lines starting with '#' and a leading header line are skipped. The
+ * first data line sets the number of columns; fields that are empty or
+ * not numbers (dates, text) read as NaN, i.e. undefined.
+ * Loading an unchanged file (same size and nanosecond modification time)
+ * again under the same name reuses the cache. On Linux the cache file is
+ * unlinked at once and kept open; elsewhere gnuplot_init() removes caches
+ * left by processes that died.
+ * threads: number of threads, 0 = one per processor
+ * rows, columns: receive the size of the data (may be NULL)
+ * Returns 0 on success, non-zero on error
+ */
+GNUPLOT_API int gnuplot_dataset_load(const char *name, const char *path, int threads,
+                                     size_t *rows, int *columns);
+
+/* Same as gnuplot_dataset_load() for text held in memory
+ * The text is always parsed; replots still reuse the cache. */
+GNUPLOT_API int gnuplot_dataset_load_buffer(const char *name, const char *data, size_t len,
+                                            int threads, size_t *rows, int *columns);
+
+/* Sample a function or parametric curve into a dataset
+ * var runs over samples evenly spaced values in [tmin, tmax]; each record
+ * is x, y with y = yexpr and x = xexpr (or var itself when xexpr is NULL).
+ * The samples go straight into a binary cache as for gnuplot_dataset_load(),
+ * so plots read them without any text conversion. Undefined points are
+ * NaN, which gnuplot treats as undefined, so lines break there.
+ * Example: gnuplot_dataset_sample("F", NULL, "sin(x)", "x", -10, 10, 100000)
+ *          gnuplot_cmd("plot @F with lines")
+ * Returns 0 on success, non-zero on error
+ */
+GNUPLOT_API int gnuplot_dataset_sample(const char *name, const char *xexpr,
+                                       const char *yexpr, const char *var,
+                                       double tmin, double tmax, int samples);
+
+/* Delete the cache of a dataset, or of all datasets when name is NULL
+ * (the variable is left as it is) */
+GNUPLOT_API void gnuplot_dataset_free(const char *name);
+
+/* Typed read-back of user variables
+ * Values are copied out of gnuplot's variable table, so results of stats,
+ * fit and GPVAL_* can be used without printing and parsing text.
+ */
+#define GNUPLOT_VAR_UNDEFINED  0  /* Not defined (or a type with no value here) */
+#define GNUPLOT_VAR_INT        1
+#define GNUPLOT_VAR_REAL       2
+#define GNUPLOT_VAR_COMPLEX    3
+#define GNUPLOT_VAR_STRING     4
+#define GNUPLOT_VAR_ARRAY      5
+#define GNUPLOT_VAR_DATABLOCK  6  /* Read with gnuplot_get_datablock() */
+
+typedef struct gnuplot_var {
+    char *name;                 /* Set by gnuplot_get_vars() */
+    int type;                   /* GNUPLOT_VAR_* */
+    long long int_val;          /* INT */
+    double real, imag;          /* INT, REAL and COMPLEX (real also holds INT) */
+    char *string;               /* STRING */
+    struct gnuplot_var *array;  /* ARRAY elements */
+    size_t size;                /* ARRAY length */
+} gnuplot_var_t;
+
+/* Read one variable, e.g. "STATS_mean" or "GPVAL_X_MAX"
+ * Returns 0 if the variable is defined, non-zero otherwise (var->type is
+ * then GNUPLOT_VAR_UNDEFINED), including for a NULL or empty name.
+ * var must not be NULL (-1 is returned). Release with gnuplot_var_clear().
+ */
+GNUPLOT_API int gnuplot_get_var(const char *name, gnuplot_var_t *var);
+
+/* Read all defined variables whose names start with prefix
+ * (NULL or "" = all), e.g. gnuplot_get_vars("STATS_", &count)
+ * Returns an array of count entries, NULL if there are none;
+ * release with gnuplot_free_vars()
+ */
+GNUPLOT_API gnuplot_var_t* gnuplot_get_vars(const char *prefix, size_t *count);
+
+/* Release the contents of a variable */
+GNUPLOT_API void gnuplot_var_clear(gnuplot_var_t *var);
+
+/* Release an array returned by gnuplot_get_vars() */
+GNUPLOT_API void gnuplot_free_vars(gnuplot_var_t *vars, size_t count);
+
+/* Copy the lines of a datablock (name with or without '$')
+ * Returns a NULL-terminated array of count lines in one allocation,
+ * release with free(); NULL if there is no such datablock or it is empty,
+ * if name is NULL or empty, or if count is NULL
+ */
+GNUPLOT_API char** gnuplot_get_datablock(const char *name, size_t *count);
+
+/* Parse the numbers of a datablock, e.g. one written by 'set table $T'
+ * Fields are split as in gnuplot_dataset_load(); the first data line sets
+ * the number of columns and other fields read as NaN.
+ * Returns rows * columns doubles (row-major), release with free();
+ * NULL if there is no such datablock or it holds no data, if name is NULL
+ * or empty, or if rows or columns is NULL
+ */
+GNUPLOT_API double* gnuplot_get_datablock_values(const char *name, size_t *rows, int *columns);
+
+/* Opaque snapshot of plot configuration */
+typedef struct gnuplot_state gnuplot_state_t;
+
+/* Capture the current settings (axes, styles, labels, terminal and its
+ * options), user-defined functions, user variables and datablocks into a
+ * snapshot.
+ * Returns NULL on error; release with gnuplot_state_free()
+ */
+GNUPLOT_API gnuplot_state_t* gnuplot_state_save(void);
+
+/* Make a snapshot the current configuration again
+ * Snapshots hold only the settings that differ from the defaults. When the
+ * settings changed now are all in the snapshot, the rest of the snapshot's
+ * are applied on top; otherwise 'reset' runs first.
+ * User variables and datablocks that are not in the snapshot are undefined.
+ * The terminal is only set again when it differs from the current one.
+ * Restoring the snapshot that is already in effect (only plot commands
+ * executed since it was saved or last restored) returns immediately.
+ * Returns 0 on success, non-zero on error
+ */
+GNUPLOT_API int gnuplot_state_restore(gnuplot_state_t *state);
+
+/* Free a snapshot returned by gnuplot_state_save */
+GNUPLOT_API void gnuplot_state_free(gnuplot_state_t *state);
+
 /* Save PBM bitmap RGB data to a global buffer before it gets freed
  * This is called automatically by the PBM terminal text() function
  * ONLY works with 'set terminal pbm color' - returns NULL for other terminals
@@ -81,7 +254,87 @@ GNUPLOT_API void* gnuplot_get_saved_pbm_rgb_data(void);
 /* Free the saved PBM bitmap data buffer */
 GNUPLOT_API void gnuplot_free_saved_pbm_bitmap(void);
 
+/* Strip-tiled raster rendering
+ * Called for each finished band of rows, top to bottom. rgb holds
+ * rows * width * 3 bytes (width is the requested width, rows are not
+ * padded) and is only valid during the call.
+ * Return 0 to continue, anything else to stop rendering. The sink runs
+ * inside the render, so the command, datablock, dataset and state
+ * functions fail there and gnuplot_close() does nothing.
+ */
+typedef int (*gnuplot_strip_sink_t)(const unsigned char *rgb, int width,
+                                    int y, int rows, void *userdata);
+
+/* Render a plot script as a width x height RGB raster in horizontal strips
+ * The script is run once on the luacmd terminal and each strip is replayed
+ * into a 'pbm color' bitmap of strip_height rows, so memory depends on the
+ * strip size instead of the output size. strip_height is rounded up to a
+ * multiple of 8 (<= 0 selects 256). The script should not change the
+ * terminal or output; the current terminal is restored afterwards.
+ * Returns 0 on success, 1 when the sink stopped rendering early, -1 on error
+ */
+GNUPLOT_API int gnuplot_render_strips(const char *script, int width, int height,
+                                      int strip_height, gnuplot_strip_sink_t sink,
+                                      void *userdata);
+
+/* Memory accounting
+ * Bytes held by the library are tracked per subsystem. Capture and bitmap
+ * figures are exact and updated as memory changes hands. Datablock and
+ * user variable figures are measured from gnuplot's variable list on the
+ * first gnuplot_mem_usage() call after a command (after every command when
+ * a datablock or UDV limit is set); gnuplot_set_datablock() keeps the
+ * datablock total current without a rescan.
+ */
+#define GNUPLOT_MEM_CAPTURE    0  /* luacmd command buffer, text, pixel blocks */
+#define GNUPLOT_MEM_BITMAP     1  /* Saved PBM RGB data */
+#define GNUPLOT_MEM_DATABLOCK  2  /* Datablock lines */
+#define GNUPLOT_MEM_UDV        3  /* Strings and arrays held by user variables */
+#define GNUPLOT_MEM_COUNT      4
+
+typedef struct {
+    size_t current;     /* Bytes held now */
+    size_t high_water;  /* Largest value of current seen */
+    size_t limit;       /* Configured limit in bytes, 0 = unlimited */
+} gnuplot_mem_usage_t;
+
+/* Get the usage of one subsystem
+ * Returns 0 on success, non-zero for an unknown subsystem
+ */
+GNUPLOT_API int gnuplot_mem_usage(int subsystem, gnuplot_mem_usage_t *usage);
+
+/* Set a limit for a subsystem (0 removes it)
+ * CAPTURE:   a plot whose capture would exceed the limit stops capturing,
+ *            its partial capture is released and the command fails; an
+ *            emptied command buffer larger than the limit is released
+ *            instead of being kept for the next plot
+ * BITMAP:    bitmaps larger than the limit are not saved
+ * DATABLOCK: gnuplot_set_datablock() fails if the total would exceed it,
+ *            and a command that leaves the total above it fails
+ * UDV:       a command that leaves user variables above the limit fails
+ * gnuplot owns datablock and variable memory, so a failing command keeps
+ * what it defined; undefine it to get back under the limit.
+ * Returns 0 on success, non-zero for an unknown subsystem
+ */
+GNUPLOT_API int gnuplot_mem_set_limit(int subsystem, size_t limit);
+
+/* Trim after every command: shrink the command buffer to the commands it
+ * holds (releasing it when empty) once each command or script completes,
+ * so resident memory follows the current plot rather than the largest one
+ */
+GNUPLOT_API void gnuplot_mem_set_trim(int enable);
+
+/* Release unused capacity now */
+GNUPLOT_API void gnuplot_mem_trim(void);
+
+/* Restart high-water tracking from the current values */
+GNUPLOT_API void gnuplot_mem_reset_high_water(void);
+
 /* luacmd terminal command capture functions */
+
+/* Drawing command
+ * The image and points members were added after the first release of the
+ * library: code built against the older, smaller luacmd_command_t must be
+ * recompiled, since the size and stride of command arrays changed. */
 typedef struct {
     int type;          /* Command type (move, vector, text, etc.) */
     int x1, y1;       /* Primary coordinates */
@@ -89,12 +342,31 @@ typedef struct {
     char *text;       /* Text string (for text commands) */
     unsigned int color; /* RGB color value */
     double value;     /* Generic value (linewidth, angle, etc.) */
+    luacmd_image_t *image; /* Pixel block (for image commands) */
+    int *points;      /* x, y pairs of all x2 corners (for filled polygons) */
 } luacmd_command_t;
 
+/* Allocate a pixel block with a reference count of 1 */
+GNUPLOT_API luacmd_image_t* luacmd_image_create(unsigned int width, unsigned int height);
+
+/* Take and drop references to a pixel block */
+GNUPLOT_API void luacmd_image_retain(luacmd_image_t *image);
+GNUPLOT_API void luacmd_image_release(luacmd_image_t *image);
+
 /* Add a drawing command to the buffer */
 GNUPLOT_API void luacmd_add_command(int type, int x1, int y1, int x2, int y2,
                       const char *text, unsigned int color, double value);
 
+/* Add an image command drawn into the box x, y, width, height
+ * Takes over the caller's reference to the pixel block */
+GNUPLOT_API void luacmd_add_image(int x, int y, int width, int height,
+                                  luacmd_image_t *image);
+
+/* Add a filled polygon with n corners (xy holds n x, y pairs)
+ * style is the fill style gnuplot passed with the first corner */
+GNUPLOT_API void luacmd_add_polygon(int n, const int *xy, unsigned int color,
+                                    int style);
+
 /* Clear all commands */
 GNUPLOT_API void luacmd_clear_commands(void);
 
@@ -108,6 +380,38 @@ GNUPLOT_API luacmd_command_t* luacmd_get_commands(int *count, int *width, int *h
 /* Free commands array returned by luacmd_get_commands */
 GNUPLOT_API void luacmd_free_commands(luacmd_command_t *commands);
 
+/* Replay captured commands through another terminal
+ * Draws commands captured on a width x height luacmd canvas with
+ * 'set terminal terminal_spec' into output, scaled to that terminal's
+ * canvas, without re-running the plot. The current terminal, output and
+ * luacmd capture are restored afterwards.
+ * Example: luacmd_replay(cmds, n, w, h, "pngcairo size 1600,1200", "plot.png")
+ * Returns 0 on success, -1 on error
+ */
+GNUPLOT_API int luacmd_replay(const luacmd_command_t *commands, int count,
+                              int width, int height,
+                              const char *terminal_spec, const char *output);
+
+/* Streaming delivery of captured commands
+ * Called with each batch of commands while the plot is still being drawn.
+ * final_chunk is non-zero for the last batch of a plot (count may be 0).
+ * The commands and their text are only valid for the duration of the call.
+ */
+typedef void (*luacmd_sink_t)(const luacmd_command_t *commands, int count,
+                              int width, int height, int final_chunk,
+                              void *userdata);
+
+/* Register a command sink, or pass NULL to return to buffered capture
+ * Commands are handed to the sink in batches of chunk_size, so the capture
+ * buffer never grows beyond one batch. chunk_size <= 0 selects 4096.
+ * While a sink is registered luacmd_get_commands() returns nothing.
+ * The sink runs inside the plotting command: it may call gnuplot_cancel(),
+ * but gnuplot_cmd() and the other command functions fail with -1 there, as
+ * do the datablock, dataset and state functions; gnuplot_close() does
+ * nothing until the command has finished.
+ */
+GNUPLOT_API void luacmd_set_sink(luacmd_sink_t sink, int chunk_size, void *userdata);
+
 #ifdef __cplusplus
 }
 #endif
@@ -3,7 +3,9 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* Forward declare bitmap variables to avoid header conflicts */
 typedef unsigned char pixels;
@@ -14,6 +16,45 @@ extern unsigned int b_planes;
 extern unsigned int b_psize;
 
 #include "libgnuplot.h"
+#ifndef _WIN32
+#include "gnuplotd_client.h"
+#endif
+
+/* Lua function registered with gnuplot.set_command_sink() */
+static lua_State *sink_L = NULL;    /* Thread the sink is called on */
+static int sink_ref = LUA_NOREF;
+static int sink_thread_ref = LUA_NOREF;
+static int sink_running = 0;
+static char *sink_error = NULL;     /* Error raised by the sink, if any */
+
+/* Commands cannot be nested inside the command that feeds the sink */
+static void check_not_in_sink(lua_State *L, const char *name)
+{
+    if (sink_running) {
+        luaL_error(L, "gnuplot.%s cannot be called from a command sink", name);
+    }
+}
+
+/* Push the result of a command: true, or false plus a reason
+ * An error raised by the command sink is reported in place of the
+ * cancellation it caused.
+ */
+static int push_command_result(lua_State *L, int result)
+{
+    if (sink_error) {
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, "command sink: %s", sink_error);
+        free(sink_error);
+        sink_error = NULL;
+        return 2;
+    }
+    lua_pushboolean(L, result == 0);
+    if (result == GNUPLOT_CANCELLED) {
+        lua_pushstring(L, "cancelled");
+        return 2;
+    }
+    return 1;
+}
 
 /* Lua: gnuplot.init() */
 static int l_gnuplot_init(lua_State *L)
@@ -23,22 +64,68 @@ static int l_gnuplot_init(lua_State *L)
     return 1;
 }
 
-/* Lua: gnuplot.cmd(command) */
+/* Lua: gnuplot.cmd(command)
+ * Returns true, or false plus a reason when cancelled or the sink failed
+ */
 static int l_gnuplot_cmd(lua_State *L)
 {
     const char *command = luaL_checkstring(L, 1);
-    int result = gnuplot_cmd(command);
-    lua_pushboolean(L, result == 0);
-    return 1;
+    int result;
+
+    check_not_in_sink(L, "cmd");
+    result = gnuplot_cmd(command);
+    return push_command_result(L, result);
+}
+
+/* Lua: gnuplot.cmd_with_deadline(command, timeout_ms)
+ * Returns true, or false plus "cancelled" when the deadline expired
+ */
+static int l_gnuplot_cmd_with_deadline(lua_State *L)
+{
+    const char *command = luaL_checkstring(L, 1);
+    lua_Integer timeout_ms = luaL_checkinteger(L, 2);
+    int result;
+
+    check_not_in_sink(L, "cmd_with_deadline");
+    if (timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+    result = gnuplot_cmd_with_deadline(command, (unsigned int)timeout_ms);
+    return push_command_result(L, result);
+}
+
+/* Lua: gnuplot.cancel()
+ * Cancel the running command (from a command sink or debug hook)
+ */
+static int l_gnuplot_cancel(lua_State *L)
+{
+    gnuplot_cancel();
+    return 0;
 }
 
 /* Lua: gnuplot.cmd_multi(commands) */
 static int l_gnuplot_cmd_multi(lua_State *L)
 {
     const char *commands = luaL_checkstring(L, 1);
-    int result = gnuplot_cmd_multi(commands);
-    lua_pushboolean(L, result == 0);
-    return 1;
+    int result;
+
+    check_not_in_sink(L, "cmd_multi");
+    result = gnuplot_cmd_multi(commands);
+    return push_command_result(L, result);
+}
+
+/* Lua: gnuplot.run_script(script)
+ * Execute a whole script in one pass (heredocs, if/do blocks, continuations)
+ */
+static int l_gnuplot_run_script(lua_State *L)
+{
+    size_t len;
+    const char *script = luaL_checklstring(L, 1, &len);
+    int result;
+
+    check_not_in_sink(L, "run_script");
+    result = gnuplot_run_script(script, len);
+    return push_command_result(L, result);
 }
 
 /* Lua: gnuplot.reset() */
@@ -51,6 +138,7 @@ static int l_gnuplot_reset(lua_State *L)
 /* Lua: gnuplot.close() */
 static int l_gnuplot_close(lua_State *L)
 {
+    check_not_in_sink(L, "close");
     gnuplot_close();
     return 0;
 }
@@ -177,6 +265,80 @@ static int l_gnuplot_get_pbm_rgb_data(lua_State *L)
     return 1;
 }
 
+/* Lua function and error state of a gnuplot.render_strips() call */
+typedef struct {
+    lua_State *L;
+    int fn;          /* Stack index of the Lua function */
+    int failed;      /* The function raised an error (message on the stack) */
+} strip_sink_state_t;
+
+/* C strip sink that forwards each band to the Lua function */
+static int lua_strip_sink(const unsigned char *rgb, int width, int y, int rows,
+                          void *userdata)
+{
+    strip_sink_state_t *state = (strip_sink_state_t *)userdata;
+    lua_State *L = state->L;
+    int stop;
+
+    lua_pushvalue(L, state->fn);
+    lua_pushlstring(L, (const char *)rgb, (size_t)width * rows * 3);
+    lua_pushinteger(L, width);
+    lua_pushinteger(L, y);
+    lua_pushinteger(L, rows);
+
+    /* Errors cannot propagate through gnuplot's plotting code */
+    sink_running = 1;
+    if (lua_pcall(L, 4, 1, 0) != LUA_OK) {
+        sink_running = 0;
+        state->failed = 1;
+        return 1;  /* Leave the message on the stack */
+    }
+    sink_running = 0;
+
+    /* Returning false stops rendering */
+    stop = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return stop;
+}
+
+/* Lua: gnuplot.render_strips(script, width, height, fn, [strip_height])
+ * Render script as a width x height RGB raster in horizontal strips,
+ * calling fn(rgb, width, y, rows) for each strip from the top down.
+ * fn may return false to stop early, which still returns true.
+ * Returns true, or nil and an error message.
+ */
+static int l_gnuplot_render_strips(lua_State *L)
+{
+    const char *script = luaL_checkstring(L, 1);
+    int width = (int)luaL_checkinteger(L, 2);
+    int height = (int)luaL_checkinteger(L, 3);
+    int strip_height = (int)luaL_optinteger(L, 5, 0);
+    strip_sink_state_t state;
+    int result;
+
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+
+    state.L = L;
+    state.fn = 4;
+    state.failed = 0;
+
+    result = gnuplot_render_strips(script, width, height, strip_height,
+                                   lua_strip_sink, &state);
+    if (state.failed) {
+        lua_pushnil(L);
+        lua_insert(L, -2);  /* nil, error from fn */
+        return 2;
+    }
+    if (result < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Failed to render strips");
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 /* Lua: gnuplot.set_datablock(name, data)
  * Set datablock content directly (bypasses heredoc syntax)
  * name: datablock name (can include $ or not)
@@ -187,38 +349,394 @@ static int l_gnuplot_set_datablock(lua_State *L)
 {
     const char *name = luaL_checkstring(L, 1);
     const char *data = luaL_checkstring(L, 2);
-    int result = gnuplot_set_datablock(name, data);
+    int result;
+
+    check_not_in_sink(L, "set_datablock");
+    result = gnuplot_set_datablock(name, data);
     lua_pushboolean(L, result == 0);
     return 1;
 }
 
-/* Lua: gnuplot.get_commands()
- * Returns drawing commands captured by luacmd terminal
- * Returns: {width=N, height=M, commands={{type=0, x=100, y=200, ...}, ...}}
+/* Push a datablock as an array of lines (nil if missing or empty)
+ * Returns 0 if nil was pushed */
+static int push_datablock_lines(lua_State *L, const char *name)
+{
+    size_t count;
+    char **lines = gnuplot_get_datablock(name, &count);
+
+    if (!lines) {
+        lua_pushnil(L);
+        return 0;
+    }
+
+    lua_createtable(L, (int)count, 0);
+    for (size_t i = 0; i < count; i++) {
+        lua_pushstring(L, lines[i]);
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+    free(lines);
+    return 1;
+}
+
+/* Push a variable: number, string, {real=, imag=} or array table */
+static void push_var(lua_State *L, const gnuplot_var_t *var, const char *name)
+{
+    switch (var->type) {
+    case GNUPLOT_VAR_INT:
+        lua_pushinteger(L, (lua_Integer)var->int_val);
+        break;
+    case GNUPLOT_VAR_REAL:
+        lua_pushnumber(L, var->real);
+        break;
+    case GNUPLOT_VAR_COMPLEX:
+        lua_createtable(L, 0, 2);
+        lua_pushnumber(L, var->real);
+        lua_setfield(L, -2, "real");
+        lua_pushnumber(L, var->imag);
+        lua_setfield(L, -2, "imag");
+        break;
+    case GNUPLOT_VAR_STRING:
+        lua_pushstring(L, var->string);
+        break;
+    case GNUPLOT_VAR_ARRAY:
+        /* Undefined elements are left as holes */
+        lua_createtable(L, (int)var->size, 0);
+        for (size_t i = 0; i < var->size; i++) {
+            if (var->array[i].type != GNUPLOT_VAR_UNDEFINED) {
+                push_var(L, &var->array[i], NULL);
+                lua_rawseti(L, -2, (lua_Integer)i + 1);
+            }
+        }
+        break;
+    case GNUPLOT_VAR_DATABLOCK:
+        (void) push_datablock_lines(L, name);
+        break;
+    default:
+        lua_pushnil(L);
+        break;
+    }
+}
+
+/* Lua: gnuplot.get_var(name)
+ * Returns the value of a variable, or nil if it is not defined
+ * Example: gnuplot.cmd("stats $DATA"); mean = gnuplot.get_var("STATS_mean")
  */
-static int l_gnuplot_get_commands(lua_State *L)
+static int l_gnuplot_get_var(lua_State *L)
 {
-    int count, width, height;
-    luacmd_command_t *commands = luacmd_get_commands(&count, &width, &height);
+    const char *name = luaL_checkstring(L, 1);
+    gnuplot_var_t var;
 
-    if (!commands || count == 0) {
+    gnuplot_get_var(name, &var);
+    push_var(L, &var, name);
+    gnuplot_var_clear(&var);
+    return 1;
+}
+
+/* Lua: gnuplot.get_vars([prefix])
+ * Returns a table of name = value for variables starting with prefix
+ */
+static int l_gnuplot_get_vars(lua_State *L)
+{
+    const char *prefix = luaL_optstring(L, 1, NULL);
+    size_t count;
+    gnuplot_var_t *vars = gnuplot_get_vars(prefix, &count);
+
+    lua_createtable(L, 0, (int)count);
+    for (size_t i = 0; i < count; i++) {
+        push_var(L, &vars[i], vars[i].name);
+        lua_setfield(L, -2, vars[i].name);
+    }
+    gnuplot_free_vars(vars, count);
+    return 1;
+}
+
+/* Lua: gnuplot.get_datablock(name [, numeric])
+ * Returns the lines of a datablock, or with numeric = true
+ * {rows=N, columns=M, {x1, y1, ...}, {x2, y2, ...}, ...}
+ */
+static int l_gnuplot_get_datablock(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    size_t rows;
+    int columns;
+    double *values;
+
+    if (!lua_toboolean(L, 2)) {
+        if (!push_datablock_lines(L, name)) {
+            lua_pushfstring(L, "No data in datablock %s", name);
+            return 2;
+        }
+        return 1;
+    }
+
+    values = gnuplot_get_datablock_values(name, &rows, &columns);
+    if (!values) {
         lua_pushnil(L);
-        lua_pushstring(L, "No commands available. Use 'set terminal luacmd' and plot something first.");
+        lua_pushfstring(L, "No data in datablock %s", name);
         return 2;
     }
 
-    /* Create result table */
-    lua_newtable(L);
+    lua_createtable(L, (int)rows, 2);
+    lua_pushinteger(L, (lua_Integer)rows);
+    lua_setfield(L, -2, "rows");
+    lua_pushinteger(L, columns);
+    lua_setfield(L, -2, "columns");
+    for (size_t r = 0; r < rows; r++) {
+        lua_createtable(L, columns, 0);
+        for (int c = 0; c < columns; c++) {
+            lua_pushnumber(L, values[r * columns + c]);
+            lua_rawseti(L, -2, c + 1);
+        }
+        lua_rawseti(L, -2, (lua_Integer)r + 1);
+    }
+    free(values);
+    return 1;
+}
 
-    /* Add width and height */
-    lua_pushinteger(L, width);
-    lua_setfield(L, -2, "width");
+/* Lua: gnuplot.dataset_load(name, path [, threads])
+ * Parse a large text file once into a binary cache for 'plot @name'
+ * Returns rows, columns on success
+ */
+static int l_gnuplot_dataset_load(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    int threads = (int)luaL_optinteger(L, 3, 0);
+    size_t rows;
+    int columns;
 
-    lua_pushinteger(L, height);
-    lua_setfield(L, -2, "height");
+    check_not_in_sink(L, "dataset_load");
+    if (gnuplot_dataset_load(name, path, threads, &rows, &columns) != 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "Cannot load dataset from %s", path);
+        return 2;
+    }
+    lua_pushinteger(L, (lua_Integer)rows);
+    lua_pushinteger(L, columns);
+    return 2;
+}
 
-    /* Add commands array */
-    lua_newtable(L);
+/* Lua: gnuplot.dataset_load_string(name, text [, threads]) */
+static int l_gnuplot_dataset_load_string(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    size_t len;
+    const char *text = luaL_checklstring(L, 2, &len);
+    int threads = (int)luaL_optinteger(L, 3, 0);
+    size_t rows;
+    int columns;
+
+    check_not_in_sink(L, "dataset_load_string");
+    if (gnuplot_dataset_load_buffer(name, text, len, threads, &rows, &columns) != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Cannot load dataset");
+        return 2;
+    }
+    lua_pushinteger(L, (lua_Integer)rows);
+    lua_pushinteger(L, columns);
+    return 2;
+}
+
+/* Lua: gnuplot.dataset_sample(name, expr, tmin, tmax, samples [, options])
+ * Sample expr into a dataset for 'plot @name with lines'
+ * options: {x = xexpr (parametric curves), var = "t"}
+ */
+static int l_gnuplot_dataset_sample(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    const char *yexpr = luaL_checkstring(L, 2);
+    double tmin = luaL_checknumber(L, 3);
+    double tmax = luaL_checknumber(L, 4);
+    int samples = (int)luaL_checkinteger(L, 5);
+    const char *xexpr = NULL;
+    const char *var = NULL;
+    int result;
+
+    check_not_in_sink(L, "dataset_sample");
+    if (lua_istable(L, 6)) {
+        lua_getfield(L, 6, "x");
+        xexpr = lua_tostring(L, -1);
+        lua_getfield(L, 6, "var");
+        var = lua_tostring(L, -1);
+    }
+
+    /* The option strings stay on the stack until we return */
+    result = gnuplot_dataset_sample(name, xexpr, yexpr, var, tmin, tmax, samples);
+    lua_pushboolean(L, result == 0);
+    return 1;
+}
+
+/* Lua: gnuplot.dataset_free([name]) */
+static int l_gnuplot_dataset_free(lua_State *L)
+{
+    check_not_in_sink(L, "dataset_free");
+    gnuplot_dataset_free(luaL_optstring(L, 1, NULL));
+    return 0;
+}
+
+/* Lua: gnuplot.eval(expr, values [, var])
+ * Evaluate expr for every number in values (an array or a single number)
+ * Returns an array of results (NaN where undefined), or a number for a number
+ */
+static int l_gnuplot_eval(lua_State *L)
+{
+    const char *expr = luaL_checkstring(L, 1);
+    const char *var = luaL_optstring(L, 3, NULL);
+    size_t n;
+    double *in;
+    int result;
+
+    if (lua_isnumber(L, 2)) {
+        double x = lua_tonumber(L, 2), y;
+        if (gnuplot_eval_batch(expr, var, &x, &y, 1) != 0) {
+            lua_pushnil(L);
+            lua_pushstring(L, "Cannot evaluate expression");
+            return 2;
+        }
+        lua_pushnumber(L, y);
+        return 1;
+    }
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_rawlen(L, 2);
+    in = (double *)malloc((n > 0 ? n : 1) * 2 * sizeof(double));
+    if (!in) {
+        return luaL_error(L, "out of memory");
+    }
+    for (size_t i = 0; i < n; i++) {
+        lua_rawgeti(L, 2, (lua_Integer)i + 1);
+        in[i] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+
+    result = gnuplot_eval_batch(expr, var, in, in + n, n);
+    if (result != 0) {
+        free(in);
+        lua_pushnil(L);
+        lua_pushstring(L, "Cannot evaluate expression");
+        return 2;
+    }
+
+    lua_createtable(L, (int)n, 0);
+    for (size_t i = 0; i < n; i++) {
+        lua_pushnumber(L, in[n + i]);
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+    free(in);
+    return 1;
+}
+
+/* Pixel blocks of image commands are exposed as userdata holding a
+ * reference, so get_commands() does not copy pixel data */
+#define IMAGE_METATABLE "gnuplot.image"
+
+static luacmd_image_t *check_image(lua_State *L)
+{
+    luacmd_image_t **ud = (luacmd_image_t **)luaL_checkudata(L, 1, IMAGE_METATABLE);
+    return *ud;
+}
+
+static void push_image(lua_State *L, luacmd_image_t *image)
+{
+    luacmd_image_t **ud = (luacmd_image_t **)lua_newuserdata(L, sizeof(luacmd_image_t *));
+    luacmd_image_retain(image);
+    *ud = image;
+    luaL_setmetatable(L, IMAGE_METATABLE);
+}
+
+/* Lua: image:width(), image:height() */
+static int l_image_width(lua_State *L)
+{
+    lua_pushinteger(L, check_image(L)->width);
+    return 1;
+}
+
+static int l_image_height(lua_State *L)
+{
+    lua_pushinteger(L, check_image(L)->height);
+    return 1;
+}
+
+/* Lua: image:rgba() - packed RGBA bytes as a string */
+static int l_image_rgba(lua_State *L)
+{
+    luacmd_image_t *image = check_image(L);
+    lua_pushlstring(L, (const char *)image->rgba, (size_t)image->width * image->height * 4);
+    return 1;
+}
+
+/* Lua: image:rgb() - packed RGB bytes as a string (e.g. for wxImage:SetData) */
+static int l_image_rgb(lua_State *L)
+{
+    luacmd_image_t *image = check_image(L);
+    size_t pixels = (size_t)image->width * image->height;
+    luaL_Buffer b;
+    char *out = luaL_buffinitsize(L, &b, pixels * 3);
+
+    for (size_t i = 0; i < pixels; i++) {
+        out[i * 3] = image->rgba[i * 4];
+        out[i * 3 + 1] = image->rgba[i * 4 + 1];
+        out[i * 3 + 2] = image->rgba[i * 4 + 2];
+    }
+    luaL_pushresultsize(&b, pixels * 3);
+    return 1;
+}
+
+/* Lua: image:alpha() - packed alpha bytes as a string (e.g. for
+ * wxImage:SetAlpha), or nil when every pixel is opaque */
+static int l_image_alpha(lua_State *L)
+{
+    luacmd_image_t *image = check_image(L);
+    size_t pixels = (size_t)image->width * image->height;
+    luaL_Buffer b;
+    char *out;
+    size_t i;
+
+    for (i = 0; i < pixels && image->rgba[i * 4 + 3] == 255; i++)
+        ;
+    if (i == pixels) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    out = luaL_buffinitsize(L, &b, pixels);
+    for (i = 0; i < pixels; i++) {
+        out[i] = image->rgba[i * 4 + 3];
+    }
+    luaL_pushresultsize(&b, pixels);
+    return 1;
+}
+
+/* Lua: image:pointer() - light userdata to the RGBA bytes (for FFI users)
+ * Valid as long as the image object is referenced */
+static int l_image_pointer(lua_State *L)
+{
+    lua_pushlightuserdata(L, check_image(L)->rgba);
+    return 1;
+}
+
+static int l_image_gc(lua_State *L)
+{
+    luacmd_image_t **ud = (luacmd_image_t **)luaL_checkudata(L, 1, IMAGE_METATABLE);
+    luacmd_image_release(*ud);
+    *ud = NULL;
+    return 0;
+}
+
+static const struct luaL_Reg image_methods[] = {
+    {"width", l_image_width},
+    {"height", l_image_height},
+    {"rgba", l_image_rgba},
+    {"rgb", l_image_rgb},
+    {"alpha", l_image_alpha},
+    {"pointer", l_image_pointer},
+    {NULL, NULL}
+};
+
+/* Push an array of command tables ({type=0, x=100, y=200, ...}, ...) */
+static void push_command_list(lua_State *L, const luacmd_command_t *commands, int count)
+{
+    lua_createtable(L, count, 0);
     for (int i = 0; i < count; i++) {
         lua_newtable(L);
 
@@ -231,8 +749,8 @@ static int l_gnuplot_get_commands(lua_State *L)
         lua_pushinteger(L, commands[i].y1);
         lua_setfield(L, -2, "y");
 
-        /* VECTOR (type 1) and FILLBOX (type 7) commands have x2, y2 */
-        if (commands[i].type == 1 || commands[i].type == 7) {
+        /* VECTOR (type 1), FILLBOX (type 7) and IMAGE (type 12) commands have x2, y2 */
+        if (commands[i].type == 1 || commands[i].type == 7 || commands[i].type == 12) {
             lua_pushinteger(L, commands[i].x2);
             lua_setfield(L, -2, "x2");
 
@@ -256,27 +774,467 @@ static int l_gnuplot_get_commands(lua_State *L)
             lua_setfield(L, -2, "value");
         }
 
+        if (commands[i].image) {
+            push_image(L, commands[i].image);
+            lua_setfield(L, -2, "image");
+        }
+
+        /* FILLED_POLYGON corners: points = {{x=.., y=..}, ...} */
+        if (commands[i].points) {
+            lua_createtable(L, commands[i].x2, 0);
+            for (int k = 0; k < commands[i].x2; k++) {
+                lua_createtable(L, 0, 2);
+                lua_pushinteger(L, commands[i].points[2 * k]);
+                lua_setfield(L, -2, "x");
+                lua_pushinteger(L, commands[i].points[2 * k + 1]);
+                lua_setfield(L, -2, "y");
+                lua_rawseti(L, -2, k + 1);
+            }
+            lua_setfield(L, -2, "points");
+        }
+
         lua_rawseti(L, -2, i + 1);
+    }
+}
 
-        /* Free text if allocated */
+/* Free a copy returned by luacmd_get_commands() */
+static void free_command_copy(luacmd_command_t *commands, int count)
+{
+    for (int i = 0; i < count; i++) {
         if (commands[i].text) {
             free(commands[i].text);
         }
+        luacmd_image_release(commands[i].image);
+        free(commands[i].points);
+    }
+    free(commands);
+}
+
+/* Lua: gnuplot.get_commands()
+ * Returns drawing commands captured by luacmd terminal
+ * Returns: {width=N, height=M, commands={{type=0, x=100, y=200, ...}, ...}}
+ */
+static int l_gnuplot_get_commands(lua_State *L)
+{
+    int count, width, height;
+    luacmd_command_t *commands = luacmd_get_commands(&count, &width, &height);
+
+    if (!commands || count == 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "No commands available. Use 'set terminal luacmd' and plot something first.");
+        return 2;
     }
 
+    /* Create result table */
+    lua_newtable(L);
+
+    /* Add width and height */
+    lua_pushinteger(L, width);
+    lua_setfield(L, -2, "width");
+
+    lua_pushinteger(L, height);
+    lua_setfield(L, -2, "height");
+
+    /* Add commands array */
+    push_command_list(L, commands, count);
     lua_setfield(L, -2, "commands");
 
-    /* Free commands array */
-    free(commands);
+    /* Free text strings, pixel block references and commands array */
+    free_command_copy(commands, count);
 
     return 1;
 }
 
+/* C sink that forwards each batch to the registered Lua function */
+static void lua_command_sink(const luacmd_command_t *commands, int count,
+                             int width, int height, int final_chunk,
+                             void *userdata)
+{
+    lua_State *L = sink_L;
+    (void) userdata;
+
+    /* The command is already being cancelled because of an earlier error */
+    if (sink_error) {
+        return;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, sink_ref);
+    push_command_list(L, commands, count);
+    lua_pushinteger(L, width);
+    lua_pushinteger(L, height);
+    lua_pushboolean(L, final_chunk);
+
+    /* Errors cannot propagate through gnuplot's plotting code - keep the
+     * message for the caller and stop the command at its next drawing call */
+    sink_running = 1;
+    if (lua_pcall(L, 4, 0, 0) != LUA_OK) {
+        const char *msg = lua_tostring(L, -1);
+        sink_error = strdup(msg ? msg : "error object is not a string");
+        lua_pop(L, 1);
+        gnuplot_cancel();
+    }
+    sink_running = 0;
+}
+
+/* Lua: gnuplot.set_command_sink(fn, [chunk_size])
+ * Stream luacmd commands to fn(commands, width, height, final) in batches
+ * of chunk_size (default 4096) while plotting. Pass nil to go back to
+ * buffered capture with get_commands().
+ */
+static int l_gnuplot_set_command_sink(lua_State *L)
+{
+    int chunk_size = (int)luaL_optinteger(L, 2, 0);
+
+    if (sink_running) {
+        return luaL_error(L, "gnuplot.set_command_sink cannot be called from a command sink");
+    }
+
+    if (lua_isnoneornil(L, 1)) {
+        luacmd_set_sink(NULL, 0, NULL);
+        luaL_unref(L, LUA_REGISTRYINDEX, sink_ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, sink_thread_ref);
+        sink_ref = LUA_NOREF;
+        sink_thread_ref = LUA_NOREF;
+        sink_L = NULL;
+        return 0;
+    }
+
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, sink_ref);
+    lua_pushvalue(L, 1);
+    sink_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    /* L may be a coroutine that is suspended or collected by the time the
+     * sink runs; call the function on a thread of its own, anchored in the
+     * registry, instead */
+    if (sink_thread_ref == LUA_NOREF) {
+        sink_L = lua_newthread(L);
+        sink_thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    luacmd_set_sink(lua_command_sink, chunk_size, NULL);
+    return 0;
+}
+
+/* Lua: gnuplot.replay(terminal_spec, output)
+ * Draw the current luacmd capture with another terminal, e.g.
+ * gnuplot.replay("pngcairo size 1600,1200", "plot.png")
+ */
+static int l_gnuplot_replay(lua_State *L)
+{
+    const char *terminal_spec = luaL_checkstring(L, 1);
+    const char *output = luaL_checkstring(L, 2);
+    int count, width, height;
+    luacmd_command_t *commands = luacmd_get_commands(&count, &width, &height);
+    int result;
+
+    if (!commands || count == 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "No commands available. Use 'set terminal luacmd' and plot something first.");
+        return 2;
+    }
+
+    result = luacmd_replay(commands, count, width, height, terminal_spec, output);
+    free_command_copy(commands, count);
+
+    if (result != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Failed to replay commands");
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Configuration snapshots are exposed as userdata with a __gc finalizer */
+#define STATE_METATABLE "gnuplot.state"
+
+/* Lua: gnuplot.state_save()
+ * Returns a snapshot of the current configuration, or nil on error
+ */
+static int l_gnuplot_state_save(lua_State *L)
+{
+    gnuplot_state_t **ud;
+    gnuplot_state_t *state;
+
+    check_not_in_sink(L, "state_save");
+    state = gnuplot_state_save();
+    if (!state) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Failed to save gnuplot state");
+        return 2;
+    }
+
+    ud = (gnuplot_state_t **)lua_newuserdata(L, sizeof(gnuplot_state_t *));
+    *ud = state;
+    luaL_setmetatable(L, STATE_METATABLE);
+    return 1;
+}
+
+/* Lua: gnuplot.state_restore(state) */
+static int l_gnuplot_state_restore(lua_State *L)
+{
+    gnuplot_state_t **ud = (gnuplot_state_t **)luaL_checkudata(L, 1, STATE_METATABLE);
+    int result = gnuplot_state_restore(*ud);
+    lua_pushboolean(L, result == 0);
+    return 1;
+}
+
+/* __gc for state snapshots */
+static int l_gnuplot_state_gc(lua_State *L)
+{
+    gnuplot_state_t **ud = (gnuplot_state_t **)luaL_checkudata(L, 1, STATE_METATABLE);
+    gnuplot_state_free(*ud);
+    *ud = NULL;
+    return 0;
+}
+
+/* Subsystem names used by the memory functions, indexed by GNUPLOT_MEM_* */
+static const char *const mem_subsystems[] = {
+    "capture", "bitmap", "datablock", "udv", NULL
+};
+
+/* Lua: gnuplot.mem_usage()
+ * Returns {capture={current=, high_water=, limit=}, bitmap=..., datablock=..., udv=...}
+ */
+static int l_gnuplot_mem_usage(lua_State *L)
+{
+    lua_newtable(L);
+    for (int i = 0; i < GNUPLOT_MEM_COUNT; i++) {
+        gnuplot_mem_usage_t usage;
+
+        if (gnuplot_mem_usage(i, &usage) != 0) {
+            continue;
+        }
+
+        lua_newtable(L);
+        lua_pushinteger(L, (lua_Integer)usage.current);
+        lua_setfield(L, -2, "current");
+        lua_pushinteger(L, (lua_Integer)usage.high_water);
+        lua_setfield(L, -2, "high_water");
+        lua_pushinteger(L, (lua_Integer)usage.limit);
+        lua_setfield(L, -2, "limit");
+        lua_setfield(L, -2, mem_subsystems[i]);
+    }
+    return 1;
+}
+
+/* Lua: gnuplot.mem_set_limit(subsystem, bytes)
+ * subsystem: "capture", "bitmap", "datablock" or "udv"; bytes = 0 removes the limit
+ */
+static int l_gnuplot_mem_set_limit(lua_State *L)
+{
+    int subsystem = luaL_checkoption(L, 1, NULL, mem_subsystems);
+    lua_Integer limit = luaL_checkinteger(L, 2);
+    int result = gnuplot_mem_set_limit(subsystem, limit > 0 ? (size_t)limit : 0);
+    lua_pushboolean(L, result == 0);
+    return 1;
+}
+
+/* Lua: gnuplot.mem_set_trim(enable) */
+static int l_gnuplot_mem_set_trim(lua_State *L)
+{
+    gnuplot_mem_set_trim(lua_toboolean(L, 1));
+    return 0;
+}
+
+/* Lua: gnuplot.mem_trim() */
+static int l_gnuplot_mem_trim(lua_State *L)
+{
+    gnuplot_mem_trim();
+    return 0;
+}
+
+/* Lua: gnuplot.mem_reset_high_water() */
+static int l_gnuplot_mem_reset_high_water(lua_State *L)
+{
+    gnuplot_mem_reset_high_water();
+    return 0;
+}
+
+#ifndef _WIN32
+/* Connection to the render daemon, kept open between calls */
+static int remote_conn = -1;
+static char *remote_path = NULL;
+
+/* Lua: gnuplot.remote_render(socket_path, script [, options])
+ * Render a script in a gnuplotd daemon instead of in this process
+ * socket_path: daemon socket (nil = default)
+ * options: {output="commands"|"rgb", width=N, height=M, priority=P,
+ *           timeout=ms}
+ * Returns the same tables as get_commands() / get_pbm_rgb_data()
+ */
+static int l_gnuplot_remote_render(lua_State *L)
+{
+    static const char *const outputs[] = {"commands", "rgb", NULL};
+    const char *path = luaL_optstring(L, 1, NULL);
+    size_t len;
+    const char *script = luaL_checklstring(L, 2, &len);
+    int output = GNUPLOTD_OUTPUT_COMMANDS;
+    lua_Integer width = 800, height = 600, priority = 0;
+    lua_Integer timeout = GNUPLOTD_DEFAULT_TIMEOUT_MS;
+    gnuplotd_frame_t frame;
+
+    if (!path) {
+        path = gnuplotd_default_socket();
+    }
+
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "output");
+        output = luaL_checkoption(L, -1, "commands", outputs);
+        lua_getfield(L, 3, "width");
+        width = luaL_optinteger(L, -1, width);
+        lua_getfield(L, 3, "height");
+        height = luaL_optinteger(L, -1, height);
+        lua_getfield(L, 3, "priority");
+        priority = luaL_optinteger(L, -1, priority);
+        lua_getfield(L, 3, "timeout");
+        timeout = luaL_optinteger(L, -1, timeout);
+        lua_pop(L, 5);
+    }
+    if (timeout < 0) {
+        timeout = 0;
+    }
+
+    /* Reconnect when the path changes or the connection broke */
+    if (remote_conn >= 0 && (!remote_path || strcmp(remote_path, path) != 0)) {
+        gnuplotd_disconnect(remote_conn);
+        remote_conn = -1;
+    }
+    for (int attempt = 0; ; attempt++) {
+        if (remote_conn < 0) {
+            remote_conn = gnuplotd_connect(path);
+            if (remote_conn < 0) {
+                lua_pushnil(L);
+                lua_pushfstring(L, "Cannot connect to gnuplotd at %s", path);
+                return 2;
+            }
+            free(remote_path);
+            remote_path = strdup(path);
+        }
+        gnuplotd_set_timeout(remote_conn, (unsigned int)timeout);
+        if (gnuplotd_render(remote_conn, script, len, output, (unsigned int)width,
+                            (unsigned int)height, (int)priority, &frame) == 0) {
+            break;
+        }
+        gnuplotd_disconnect(remote_conn);
+        remote_conn = -1;
+        if (attempt > 0) {
+            lua_pushnil(L);
+            lua_pushstring(L, "Connection to gnuplotd lost");
+            return 2;
+        }
+    }
+
+    if (frame.status != GNUPLOTD_OK) {
+        lua_pushnil(L);
+        lua_pushstring(L, frame.status == GNUPLOTD_ERR_SCRIPT ? "Script failed" :
+                          frame.status == GNUPLOTD_ERR_REQUEST ? "Request rejected by gnuplotd" :
+                          frame.status == GNUPLOTD_ERR_TIMEOUT ? "gnuplotd timed out" :
+                          "gnuplotd could not render the frame");
+        return 2;
+    }
+
+    if (output == GNUPLOTD_OUTPUT_RGB) {
+        unsigned int w, h;
+        const unsigned char *rgb = gnuplotd_frame_rgb(&frame, &w, &h);
+
+        if (!rgb) {
+            gnuplotd_frame_release(&frame);
+            lua_pushnil(L);
+            lua_pushstring(L, "Malformed frame");
+            return 2;
+        }
+
+        lua_newtable(L);
+        lua_pushinteger(L, w);
+        lua_setfield(L, -2, "width");
+        lua_pushinteger(L, h);
+        lua_setfield(L, -2, "height");
+        lua_pushlstring(L, (const char *)rgb, (size_t)w * h * 3);
+        lua_setfield(L, -2, "data");
+    } else {
+        unsigned int count, w, h;
+        const gnuplotd_command_t *records = gnuplotd_frame_commands(&frame, &count, &w, &h);
+        const char *base = (const char *)frame.data;
+        luacmd_command_t *commands;
+
+        if (!records) {
+            gnuplotd_frame_release(&frame);
+            lua_pushnil(L);
+            lua_pushstring(L, "Malformed frame");
+            return 2;
+        }
+
+        /* Text points into the frame; images are copied into pixel blocks */
+        commands = (luacmd_command_t *)calloc(count > 0 ? count : 1, sizeof(luacmd_command_t));
+        if (!commands) {
+            gnuplotd_frame_release(&frame);
+            return luaL_error(L, "out of memory");
+        }
+        for (unsigned int i = 0; i < count; i++) {
+            const gnuplotd_command_t *rec = &records[i];
+            size_t pixels_size = (size_t)rec->image_width * rec->image_height * 4;
+
+            commands[i].type = rec->type;
+            commands[i].x1 = rec->x1;
+            commands[i].y1 = rec->y1;
+            commands[i].x2 = rec->x2;
+            commands[i].y2 = rec->y2;
+            commands[i].color = rec->color;
+            commands[i].value = rec->value;
+            if (rec->text_offset && rec->text_offset < frame.size &&
+                memchr(base + rec->text_offset, 0, frame.size - rec->text_offset)) {
+                commands[i].text = (char *)(base + rec->text_offset);
+            }
+            if (rec->image_offset && rec->image_offset + pixels_size <= frame.size) {
+                commands[i].image = luacmd_image_create(rec->image_width, rec->image_height);
+                if (commands[i].image) {
+                    memcpy(commands[i].image->rgba, base + rec->image_offset, pixels_size);
+                }
+            }
+            if (rec->points_offset && rec->x2 > 0 &&
+                rec->points_offset + 2 * (size_t)rec->x2 * sizeof(int32_t) <= frame.size) {
+                commands[i].points = (int *)malloc(2 * (size_t)rec->x2 * sizeof(int));
+                if (commands[i].points) {
+                    const int32_t *xy = (const int32_t *)(base + rec->points_offset);
+                    for (int k = 0; k < 2 * rec->x2; k++) {
+                        commands[i].points[k] = xy[k];
+                    }
+                }
+            }
+        }
+
+        lua_newtable(L);
+        lua_pushinteger(L, w);
+        lua_setfield(L, -2, "width");
+        lua_pushinteger(L, h);
+        lua_setfield(L, -2, "height");
+        push_command_list(L, commands, (int)count);
+        lua_setfield(L, -2, "commands");
+
+        for (unsigned int i = 0; i < count; i++) {
+            luacmd_image_release(commands[i].image);
+            free(commands[i].points);
+        }
+        free(commands);
+    }
+
+    gnuplotd_frame_release(&frame);
+    return 1;
+}
+#endif
+
 /* Library registration */
 static const struct luaL_Reg gnuplot_lib[] = {
     {"init", l_gnuplot_init},
     {"cmd", l_gnuplot_cmd},
+    {"cmd_with_deadline", l_gnuplot_cmd_with_deadline},
+    {"cancel", l_gnuplot_cancel},
     {"cmd_multi", l_gnuplot_cmd_multi},
+    {"run_script", l_gnuplot_run_script},
     {"reset", l_gnuplot_reset},
     {"close", l_gnuplot_close},
     {"version", l_gnuplot_version},
@@ -286,14 +1244,49 @@ static const struct luaL_Reg gnuplot_lib[] = {
     {"set", l_gnuplot_set},
     {"unset", l_gnuplot_unset},
     {"set_datablock", l_gnuplot_set_datablock},
+    {"get_var", l_gnuplot_get_var},
+    {"get_vars", l_gnuplot_get_vars},
+    {"get_datablock", l_gnuplot_get_datablock},
+    {"eval", l_gnuplot_eval},
+    {"dataset_load", l_gnuplot_dataset_load},
+    {"dataset_load_string", l_gnuplot_dataset_load_string},
+    {"dataset_sample", l_gnuplot_dataset_sample},
+    {"dataset_free", l_gnuplot_dataset_free},
     {"get_pbm_rgb_data", l_gnuplot_get_pbm_rgb_data},
+    {"render_strips", l_gnuplot_render_strips},
     {"get_commands", l_gnuplot_get_commands},
+    {"set_command_sink", l_gnuplot_set_command_sink},
+    {"replay", l_gnuplot_replay},
+    {"state_save", l_gnuplot_state_save},
+    {"state_restore", l_gnuplot_state_restore},
+    {"mem_usage", l_gnuplot_mem_usage},
+    {"mem_set_limit", l_gnuplot_mem_set_limit},
+    {"mem_set_trim", l_gnuplot_mem_set_trim},
+    {"mem_trim", l_gnuplot_mem_trim},
+    {"mem_reset_high_water", l_gnuplot_mem_reset_high_water},
+#ifndef _WIN32
+    {"remote_render", l_gnuplot_remote_render},
+#endif
     {NULL, NULL}
 };
 
 /* Module initialization */
 int luaopen_gnuplot(lua_State *L)
 {
+    /* Metatable for state snapshots */
+    luaL_newmetatable(L, STATE_METATABLE);
+    lua_pushcfunction(L, l_gnuplot_state_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    /* Metatable for image pixel blocks */
+    luaL_newmetatable(L, IMAGE_METATABLE);
+    lua_pushcfunction(L, l_image_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, image_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
     luaL_newlib(L, gnuplot_lib);
     return 1;
 }
@@ -0,0 +1,22 @@
+/* GNUPLOT - luacmd_image.h */
+
+/*
+ * Pixel blocks of luacmd image commands
+ * Shared by libgnuplot.h and the luacmd terminal (term/luacmd.trm), which
+ * cannot include libgnuplot.h itself.
+ */
+
+#ifndef LUACMD_IMAGE_H
+#define LUACMD_IMAGE_H
+
+/* Packed RGBA pixel block for image commands
+ * Rows are stored top to bottom, 4 bytes per pixel (R, G, B, A).
+ * Blocks are reference counted so they can be handed out without copying.
+ */
+typedef struct {
+    int refcount;
+    unsigned int width, height;   /* Size in image pixels */
+    unsigned char *rgba;          /* width * height * 4 bytes */
+} luacmd_image_t;
+
+#endif /* LUACMD_IMAGE_H */
@@ -26,14 +26,30 @@ local gnuplot = require("gnuplot")
 -- Wrap core gnuplot functions for direct access
 wxgnuplot.init = gnuplot.init
 wxgnuplot.cmd = gnuplot.cmd
+wxgnuplot.cmd_with_deadline = gnuplot.cmd_with_deadline
+wxgnuplot.cancel = gnuplot.cancel
 wxgnuplot.cmd_multi = gnuplot.cmd_multi
+wxgnuplot.run_script = gnuplot.run_script
 wxgnuplot.reset = gnuplot.reset
 wxgnuplot.close = gnuplot.close
 wxgnuplot.version = gnuplot.version
 wxgnuplot.is_initialized = gnuplot.is_initialized
 wxgnuplot.set_datablock = gnuplot.set_datablock
+wxgnuplot.get_var = gnuplot.get_var
+wxgnuplot.get_vars = gnuplot.get_vars
+wxgnuplot.get_datablock = gnuplot.get_datablock
+wxgnuplot.eval = gnuplot.eval
+wxgnuplot.dataset_load = gnuplot.dataset_load
+wxgnuplot.dataset_load_string = gnuplot.dataset_load_string
+wxgnuplot.dataset_sample = gnuplot.dataset_sample
+wxgnuplot.dataset_free = gnuplot.dataset_free
 wxgnuplot.get_pbm_rgb_data = gnuplot.get_pbm_rgb_data
+wxgnuplot.render_strips = gnuplot.render_strips
+wxgnuplot.state_save = gnuplot.state_save
+wxgnuplot.state_restore = gnuplot.state_restore
 wxgnuplot.get_commands = gnuplot.get_commands
+wxgnuplot.set_command_sink = gnuplot.set_command_sink
+wxgnuplot.replay = gnuplot.replay
 
 -- Convenience functions
 function wxgnuplot.plot(expression, options)
@@ -93,6 +109,7 @@ local CMD_FILLED_POLYGON = 8
 local CMD_TEXT_ANGLE = 9
 local CMD_JUSTIFY = 10
 local CMD_SET_FONT = 11
+local CMD_IMAGE = 12
 
 -- Text justification modes
 local JUSTIFY_LEFT = 0
@@ -117,6 +134,29 @@ local function is_plot_curve(points)
     return #points > 20
 end
 
+-- Commands that draw, or may draw, with their shortest abbreviations
+local DRAWING_COMMANDS = {
+    {"plot", 1}, {"splot", 2}, {"replot", 3}, {"refresh", 4},
+    {"do", 2}, {"if", 2}, {"while", 5}, {"load", 1}, {"call", 3}, {"eval", 2},
+}
+
+-- Does any statement of a command line draw? Everything else is
+-- configuration that a state snapshot brings back.
+local function is_drawing_command(command)
+    for statement in (command .. ";"):gmatch("([^;]*);") do
+        local word = statement:match("^%s*(%a+)")
+        if word then
+            for _, entry in ipairs(DRAWING_COMMANDS) do
+                local name, shortest = entry[1], entry[2]
+                if #word >= shortest and name:sub(1, #word) == word then
+                    return true
+                end
+            end
+        end
+    end
+    return false
+end
+
 -- Render gnuplot commands to a wxBitmap
 -- Returns: wxBitmap or nil on error
 local function render_commands(commands, width, height)
@@ -265,6 +305,37 @@ local function render_commands(commands, width, height)
             memDC:SetBrush(brush)
             memDC:DrawRectangle(cmd.x, cmd.y, cmd.x2, cmd.y2)
 
+        elseif cmd.type == CMD_FILLED_POLYGON then
+            if path_active then flush_path() end
+            -- cmd.points = {{x=.., y=..}, ...}
+            if cmd.points and #cmd.points > 2 then
+                local points = {}
+                for k, p in ipairs(cmd.points) do
+                    points[k] = wx.wxPoint(p.x, p.y)
+                end
+                memDC:SetBrush(wx.wxBrush(pen_color, wx.wxBRUSHSTYLE_SOLID))
+                memDC:SetPen(wx.wxPen(pen_color, 1, wx.wxPENSTYLE_SOLID))
+                memDC:DrawPolygon(points)
+                memDC:SetPen(wx.wxPen(pen_color, pen_width, pen_style))
+            end
+
+        elseif cmd.type == CMD_IMAGE then
+            if path_active then flush_path() end
+            -- Blit the whole pixel block scaled to its box
+            -- cmd.x = x, cmd.y = y, cmd.x2 = width, cmd.y2 = height
+            if cmd.image and cmd.x2 > 0 and cmd.y2 > 0 then
+                local image = wx.wxImage(cmd.image:width(), cmd.image:height(), false)
+                image:SetData(cmd.image:rgb())
+                -- rgbalpha images keep their transparency; opaque ones
+                -- get no alpha channel
+                local alpha = cmd.image:alpha()
+                if alpha then
+                    image:SetAlpha(alpha)
+                end
+                image:Rescale(cmd.x2, cmd.y2)
+                memDC:DrawBitmap(wx.wxBitmap(image), cmd.x, cmd.y, alpha ~= nil)
+            end
+
         elseif cmd.type == CMD_JUSTIFY then
             text_justify = cmd.x
 
@@ -304,7 +375,10 @@ function wxgnuplot.new(parent, id, pos, size)
         width = size:GetWidth(),
         height = size:GetHeight(),
         gnuplot = gnuplot,
-        gnuplot_initialized = false
+        gnuplot_initialized = false,
+        state = nil,              -- Snapshot of the configuration after execute()
+        state_width = 0,
+        state_height = 0
     }
 
     -- Create wxPanel
@@ -405,6 +479,7 @@ function wxgnuplot.new(parent, id, pos, size)
     -- Method: Add a gnuplot command to the stack
     function plot:cmd(command)
         table.insert(self.commands, command)
+        self.state = nil
     end
 
     -- Method: Add multi-line command block (for data blocks, heredocs, etc.)
@@ -413,9 +488,13 @@ function wxgnuplot.new(parent, id, pos, size)
     function plot:cmd_multi(commands)
         -- Store multi-line commands to be executed before plotting
         table.insert(self.multiline_commands, commands)
+        self.state = nil
     end
 
     -- Method: Execute all stacked commands and render
+    -- The first run sends every command and snapshots the configuration;
+    -- later runs (resizes, redraws) restore the snapshot, which switches
+    -- only the settings that differ, and send just the drawing commands
     function plot:execute()
         if #self.commands == 0 and #self.multiline_commands == 0 then
             return false, "No commands to execute"
@@ -427,19 +506,46 @@ function wxgnuplot.new(parent, id, pos, size)
             self.gnuplot_initialized = true
         end
 
-        -- Set terminal first
-        self.gnuplot.cmd(string.format("set terminal luacmd size %d,%d", self.width, self.height))
+        local terminal = string.format("set terminal luacmd size %d,%d", self.width, self.height)
+        local resized = self.width ~= self.state_width or self.height ~= self.state_height
 
-        -- Process regular commands (set commands) before data blocks
-        for i, cmd in ipairs(self.commands) do
-            -- Execute the user command
-            self.gnuplot.cmd(cmd)
+        if self.state and not self.gnuplot.state_restore(self.state) then
+            self.state = nil
+        end
+
+        if self.state then
+            -- Settings, functions, variables and the terminal came back
+            -- with the snapshot; only a new size needs the terminal again
+            if resized then
+                self.gnuplot.cmd(terminal)
+            end
+            for i, cmd in ipairs(self.commands) do
+                if is_drawing_command(cmd) then
+                    self.gnuplot.cmd(cmd)
+                end
+            end
+        else
+            -- Set terminal first
+            self.gnuplot.cmd(terminal)
+
+            -- Process regular commands (set commands) before data blocks
+            for i, cmd in ipairs(self.commands) do
+                -- Execute the user command
+                self.gnuplot.cmd(cmd)
+            end
         end
 
         -- Execute multi-line commands (data blocks + plot) last
-        -- Send as single command to preserve heredoc syntax
+        -- Run each block as a script so heredocs are parsed natively
         for i, multicmd in ipairs(self.multiline_commands) do
-            self.gnuplot.cmd(multicmd)
+            self.gnuplot.run_script(multicmd)
+        end
+
+        -- Snapshot the configuration for the next execute()
+        if not self.state or resized then
+            self.state = self.gnuplot.state_save()
+            self.state_width = self.width
+            self.state_height = self.height
         end
 
         -- Get rendering commands
@@ -465,6 +571,7 @@ function wxgnuplot.new(parent, id, pos, size)
     function plot:clear()
         self.commands = {}
         self.multiline_commands = {}
+        self.state = nil
     end
 
     -- Method: Force repaint